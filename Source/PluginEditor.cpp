@@ -7,6 +7,15 @@
 #include <cstdint>
 #include "PluginEditor.h"
 
+static juce::String dimension_name(const RowDimension &dim)
+{
+    if (dim.target == DimensionTarget::NoteLength)
+        return "Note length";
+    if (dim.target == DimensionTarget::MidiChannel)
+        return "MIDI channel";
+    return "CC " + juce::String(dim.controller);
+}
+
 //==============================================================================
 AudioPluginAudioProcessorEditor::AudioPluginAudioProcessorEditor(AudioPluginAudioProcessor &p)
     : AudioProcessorEditor(&p), processorRef(p),
@@ -14,55 +23,187 @@ AudioPluginAudioProcessorEditor::AudioPluginAudioProcessorEditor(AudioPluginAudi
 {
     addAndMakeVisible(keyboardComponent);
     processorRef.keyboardState.addListener(this);
+    processorRef.keyboardStateEnabled = true;
 
     addAndMakeVisible(selfSequenceToggle);
     selfSequenceToggle.setButtonText("Self sequence");
-    selfSequenceToggle.setToggleState(processorRef.selfSequence, juce::dontSendNotification);
-    selfSequenceToggle.onClick = [this]() {
-        MessageToProcessor msg;
-        msg.opcode = MessageToProcessor::OP_ChangeIntParameter;
-        msg.par_index = 0;
-        msg.par_ivalue = selfSequenceToggle.getToggleState();
-        processorRef.fifo_to_processor.push(msg);
+    selfSequenceAttachment = std::make_unique<juce::ButtonParameterAttachment>(
+        *processorRef.parameters.selfSequence, selfSequenceToggle);
+
+    addAndMakeVisible(recordSessionToggle);
+    recordSessionToggle.setButtonText("Record session");
+    recordSessionToggle.setToggleState(processorRef.sessionRecorder.isRecording(),
+                                       juce::dontSendNotification);
+    recordSessionToggle.onClick = [this]() {
+        if (recordSessionToggle.getToggleState())
+        {
+            auto file = juce::File::getSpecialLocation(juce::File::userDocumentsDirectory)
+                            .getChildFile("RowManager")
+                            .getChildFile("session_" +
+                                          juce::Time::getCurrentTime().formatted("%Y%m%d_%H%M%S") +
+                                          ".rmlog");
+            if (!processorRef.startSessionRecording(file))
+                recordSessionToggle.setToggleState(false, juce::dontSendNotification);
+        }
+        else
+        {
+            processorRef.stopSessionRecording();
+        }
+    };
+
+    addAndMakeVisible(clockGroupSlider);
+    clockGroupSlider.setSliderStyle(juce::Slider::SliderStyle::IncDecButtons);
+    clockGroupSlider.setTextBoxStyle(juce::Slider::TextEntryBoxPosition::TextBoxLeft, false, 30,
+                                     24);
+    clockGroupSlider.setTooltip("Shared clock group, 0 for none");
+    clockGroupAttachment = std::make_unique<juce::SliderParameterAttachment>(
+        *processorRef.parameters.sharedClockGroup, clockGroupSlider);
+
+#if ROWMANAGER_TRACING
+    addAndMakeVisible(writeTraceButton);
+    writeTraceButton.setButtonText("Write trace");
+    writeTraceButton.onClick = [this]() {
+        auto file = juce::File::getSpecialLocation(juce::File::userDocumentsDirectory)
+                        .getChildFile("RowManager")
+                        .getChildFile("trace_" +
+                                      juce::Time::getCurrentTime().formatted("%Y%m%d_%H%M%S") +
+                                      ".json");
+        processorRef.writeTrace(file);
+    };
+#endif
+
+    addAndMakeVisible(addDimensionButton);
+    addDimensionButton.setButtonText("Add row...");
+    addDimensionButton.onClick = [this]() {
+        auto add = [this](RowDimension dim, Row row) {
+            if (processorRef.addRowDimension(dim, row))
+            {
+                addDimensionComponent(processorRef.rowDimensions.size() - 1);
+                updateEditorSize();
+            }
+        };
+        juce::PopupMenu menu;
+        juce::PopupMenu ccmenu;
+        // 120 and up are the channel mode messages
+        for (uint8_t cc = 0; cc < 120; ++cc)
+            ccmenu.addItem("CC " + juce::String(cc), [add, cc]() {
+                add({DimensionTarget::ControlChange, cc, 0, 127, 1}, Row::make_chromatic(8));
+            });
+        menu.addSubMenu("CC", ccmenu);
+        menu.addItem("Note length", [add]() {
+            add({DimensionTarget::NoteLength, 0, 1, 4, 1}, Row::make_chromatic(4));
+        });
+        menu.addItem("MIDI channel", [add]() {
+            add({DimensionTarget::MidiChannel, 0, 1, 4, 1}, Row::make_chromatic(4));
+        });
+        menu.showMenuAsync(juce::PopupMenu::Options{});
     };
 
     addAndMakeVisible(debugLabel);
+    for (auto &voiceparameters : shownTransformParameters)
+        voiceparameters.fill(-1);
 
-    rowComponents.push_back(std::make_unique<RowComponent>("Pitch Class", RID_PITCHCLASS,
-                                                           processorRef.rows[RID_PITCHCLASS],
-                                                           processorRef.fifo_to_processor));
-    rowComponents.push_back(std::make_unique<RowComponent>("Onset difference", RID_DELTATIME,
-                                                           processorRef.rows[RID_DELTATIME],
-                                                           processorRef.fifo_to_processor));
+    // The engine's rows can change on the audio thread at any time, so the editor starts from
+    // their snapshots
+    std::array<Row, RID_LAST> rows;
+    for (size_t rid = 0; rid < RID_LAST; ++rid)
+        processorRef.engine.rowSnapshots[rid].read(rows[rid]);
+    rowComponents.push_back(std::make_unique<RowComponent>(
+        "Pitch Class", RID_PITCHCLASS, rows[RID_PITCHCLASS], processorRef.fifo_to_processor));
     rowComponents.push_back(std::make_unique<RowComponent>(
-        "Octave", RID_OCTAVE, processorRef.rows[RID_OCTAVE], processorRef.fifo_to_processor));
+        "Onset difference", RID_DELTATIME, rows[RID_DELTATIME], processorRef.fifo_to_processor));
+    rowComponents.push_back(std::make_unique<RowComponent>("Octave", RID_OCTAVE, rows[RID_OCTAVE],
+                                                           processorRef.fifo_to_processor));
 
     rowComponents.push_back(std::make_unique<VelocityRowComponent>(
-        "Velocity", RID_VELOCITY, processorRef.rows[RID_VELOCITY], processorRef.fifo_to_processor));
-    rowComponents.push_back(std::make_unique<RowComponent>(
-        "PolyAT", RID_POLYAT, processorRef.rows[RID_POLYAT], processorRef.fifo_to_processor));
+        "Velocity", RID_VELOCITY, rows[RID_VELOCITY], processorRef.fifo_to_processor,
+        *processorRef.parameters.velocityLow));
+    rowComponents.push_back(std::make_unique<RowComponent>("PolyAT", RID_POLYAT, rows[RID_POLYAT],
+                                                           processorRef.fifo_to_processor));
     for (size_t i = 0; i < rowComponents.size(); ++i)
     {
         addAndMakeVisible(rowComponents[i].get());
         rowComponents[i]->OnEdited = [this, i](size_t id) {
-            for (int j = 0; j < max_poly_voices; ++j)
+            MessageToProcessor msg;
+            msg.opcode = MessageToProcessor::OP_ChangeRow;
+            msg.row_index = id;
+            msg.row = rowComponents[i]->stepComponent.steps;
+            processorRef.fifo_to_processor.push(msg);
+        };
+        rowComponents[i]->OnTransformChosen = [this, i](size_t voice, RowTransform t) {
+            auto par = processorRef.parameters.transforms[rowComponents[i]->rowid][voice];
+            par->beginChangeGesture();
+            *par = transform_to_index(t);
+            par->endChangeGesture();
+        };
+        rowComponents[i]->OnPlaylistChosen = [this, i](size_t id, juce::File file) {
+            RowPlaylist playlist;
+            if (file.existsAsFile())
             {
-                MessageToProcessor msg;
-                msg.opcode = MessageToProcessor::OP_ChangeRow;
-                msg.row_index = id;
-                msg.voice_index = j;
-                msg.row = rowComponents[i]->stepComponent.steps;
-                msg.transform = rowComponents[i]->stepComponent.row_iterators[j].transform;
-                processorRef.fifo_to_processor.push(msg);
+                std::istringstream is(file.loadFileAsString().toStdString());
+                std::string error;
+                auto parsed = parse_playlist(is, error);
+                if (!parsed)
+                {
+                    juce::AlertWindow::showMessageBoxAsync(juce::MessageBoxIconType::WarningIcon,
+                                                           "Invalid playlist", error);
+                    return;
+                }
+                playlist = std::move(*parsed);
             }
+            processorRef.setRowPlaylist(id, std::move(playlist));
+            rowComponents[i]->infoLabel.setText(rowComponents[i]->rowName,
+                                                juce::dontSendNotification);
         };
     }
-    setSize(1000, 800);
-    startTimer(100);
+    for (size_t i = 0; i < processorRef.rowDimensions.size(); ++i)
+        addDimensionComponent(i);
+    updateEditorSize();
+    // The playback state is read at a constant cost, so this can run at the repaint rate
+    startTimerHz(30);
+}
+
+void AudioPluginAudioProcessorEditor::addDimensionComponent(size_t index)
+{
+    const auto &state = processorRef.rowDimensions[index];
+    auto comp = std::make_unique<DimensionRowComponent>(dimension_name(state.dimension), state.row);
+    auto c = comp.get();
+    // The dimensions move down when one is removed, so the index is looked up when needed
+    auto indexOf = [this, c]() -> size_t {
+        for (size_t i = 0; i < dimensionComponents.size(); ++i)
+            if (dimensionComponents[i].get() == c)
+                return i;
+        return dimensionComponents.size();
+    };
+    c->stepComponent.OnEdited = [this, c, indexOf]() {
+        processorRef.setRowDimensionRow(indexOf(), c->stepComponent.steps);
+    };
+    c->OnRemove = [this, indexOf]() {
+        // Deleting the component from its own button's callback isn't safe
+        juce::MessageManager::callAsync(
+            [safeThis = juce::Component::SafePointer(this), indexOf]() {
+                if (!safeThis)
+                    return;
+                size_t i = indexOf();
+                if (i >= safeThis->dimensionComponents.size())
+                    return;
+                safeThis->processorRef.removeRowDimension(i);
+                safeThis->dimensionComponents.erase(safeThis->dimensionComponents.begin() + i);
+                safeThis->updateEditorSize();
+            });
+    };
+    addAndMakeVisible(c);
+    dimensionComponents.push_back(std::move(comp));
+}
+
+void AudioPluginAudioProcessorEditor::updateEditorSize()
+{
+    setSize(1000, 800 + 80 * (int)dimensionComponents.size());
 }
 
 AudioPluginAudioProcessorEditor::~AudioPluginAudioProcessorEditor()
 {
+    processorRef.keyboardStateEnabled = false;
     processorRef.keyboardState.removeListener(this);
 }
 
@@ -73,36 +214,76 @@ void AudioPluginAudioProcessorEditor::handleNoteOn(juce::MidiKeyboardState *sour
 
 void AudioPluginAudioProcessorEditor::timerCallback()
 {
+    RM_TRACE_THREAD("message");
+    RM_TRACE_SCOPE("timerCallback");
     MessageToUI msg;
-    while (processorRef.fifo_to_ui.pop(msg))
+    while (processorRef.engine.fifo_to_ui.pop(msg))
     {
-        if (msg.opcode == MessageToUI::OP_StepPositionChanged)
+        RM_TRACE_INSTANT("MessageToUI", msg.opcode);
+        if (msg.opcode == MessageToUI::OP_VoiceCountChanged)
         {
             for (auto &c : rowComponents)
             {
-                c->stepComponent.setPlayingStep(msg.voice_index, msg.playpositions[c->rowid]);
+                c->stepComponent.num_active_voices = msg.par0;
             }
         }
-        if (msg.opcode == MessageToUI::OP_VoiceCountChanged)
+        if (msg.opcode == MessageToUI::OP_RowChanged)
         {
             for (auto &c : rowComponents)
             {
-                c->stepComponent.num_active_voices = msg.par0;
+                if (c->rowid == (size_t)msg.par0)
+                    c->setRow(msg.row, msg.par1);
             }
         }
-        if (msg.opcode == MessageToUI::OP_RowTransformChanged)
+        if (msg.opcode == MessageToUI::OP_TransformChanged)
         {
             for (auto &c : rowComponents)
             {
-                // c->
+                if (c->rowid == (size_t)msg.par0 && (size_t)msg.par1 < max_poly_voices)
+                    c->stepComponent.row_iterators[msg.par1].transform = msg.transform;
             }
         }
     }
+    // Only the latest steps are shown, so the voices that triggered since the last update are
+    // read from the published state instead of getting a message for every trigger
+    PlaybackState playback;
+    if (processorRef.engine.playbackState.read(playback))
+    {
+        for (size_t v = 0; v < max_poly_voices; ++v)
+        {
+            if (playback.triggerCounts[v] == shownTriggerCounts[v])
+                continue;
+            shownTriggerCounts[v] = playback.triggerCounts[v];
+            for (auto &c : rowComponents)
+                c->stepComponent.setPlayingStep(v, playback.playpositions[v][c->rowid]);
+        }
+    }
+    // The transforms can also be changed by host automation. Like in the engine, a parameter
+    // only overrides a mutated transform when the parameter itself changes.
+    for (auto &c : rowComponents)
+    {
+        auto &steps = c->stepComponent;
+        for (size_t j = 0; j < max_poly_voices; ++j)
+        {
+            const int index = processorRef.parameters.transforms[c->rowid][j]->get();
+            if (index == shownTransformParameters[c->rowid][j])
+                continue;
+            shownTransformParameters[c->rowid][j] = index;
+            steps.row_iterators[j].transform = transform_from_index(index);
+        }
+        steps.updateAnalysis();
+    }
+    for (auto &c : dimensionComponents)
+        c->stepComponent.updateAnalysis();
     juce::String txt;
-    txt << processorRef.playingNotes.size() << " playing notes ";
+    txt << processorRef.engine.playingNotes.size() << " playing notes ";
     txt << processorRef.pending_rows.size() << " pending row changes, BPM ";
     txt << processorRef.curBPM;
     txt << " cur PPQ Pos " << processorRef.curPPQPos;
+    // a log with dropped records fails to replay
+    auto &recorder = processorRef.sessionRecorder;
+    if (recorder.isRecording() || recorder.getNumDroppedRecords() > 0)
+        txt << ", " << (juce::int64)recorder.getNumDroppedRecords() << " log records dropped";
     debugLabel.setText(txt, juce::dontSendNotification);
 }
 
@@ -118,7 +299,15 @@ void AudioPluginAudioProcessorEditor::resized()
 {
     int yoffs = 1;
     selfSequenceToggle.setBounds(1, yoffs, 120, 24);
-    debugLabel.setBounds(selfSequenceToggle.getRight() + 1, 1, getWidth() - 125, 24);
+    recordSessionToggle.setBounds(selfSequenceToggle.getRight() + 1, yoffs, 130, 24);
+    clockGroupSlider.setBounds(recordSessionToggle.getRight() + 1, yoffs, 90, 24);
+    addDimensionButton.setBounds(clockGroupSlider.getRight() + 1, yoffs, 100, 24);
+    int labelx = addDimensionButton.getRight() + 1;
+#if ROWMANAGER_TRACING
+    writeTraceButton.setBounds(labelx, yoffs, 100, 24);
+    labelx = writeTraceButton.getRight() + 1;
+#endif
+    debugLabel.setBounds(labelx, 1, getWidth() - labelx - 2, 24);
     yoffs += 25;
     rowComponents[0]->setBounds(1, yoffs, getWidth() - 2, 175);
     yoffs += 178;
@@ -128,5 +317,11 @@ void AudioPluginAudioProcessorEditor::resized()
     rowComponents[3]->setBounds(1 + getWidth() / 2, yoffs, getWidth() / 2 - 2, 175);
     yoffs += 178;
     rowComponents[4]->setBounds(1, yoffs, getWidth(), 175);
+    yoffs += 178;
+    for (auto &c : dimensionComponents)
+    {
+        c->setBounds(1, yoffs, getWidth() - 2, 77);
+        yoffs += 80;
+    }
     keyboardComponent.setBounds(1, getBottom() - 50, getWidth() - 2, 50);
 }
@@ -8,6 +8,7 @@
 #include "juce_graphics/juce_graphics.h"
 #include "juce_gui_basics/juce_gui_basics.h"
 #include "row_engine.h"
+#include "row_analysis.h"
 #include <cstdint>
 
 class MultiStepComponent : public juce::Component
@@ -22,6 +23,22 @@ class MultiStepComponent : public juce::Component
         repaint();
     }
     std::function<void()> OnEdited = nullptr;
+    // Called from the editor's timer. The validity and the voices' transformed rows are
+    // computed on the row analysis thread, the component repaints when they change.
+    void updateAnalysis()
+    {
+        analysisClient.submit(makeAnalysisRequest());
+        if (analysisClient.fetch(analysis))
+            repaint();
+    }
+    RowAnalysisRequest makeAnalysisRequest() const
+    {
+        RowAnalysisRequest request;
+        request.row = steps;
+        for (size_t i = 0; i < max_poly_voices; ++i)
+            request.transforms[i] = row_iterators[i].transform;
+        return request;
+    }
 
     void mouseDown(const juce::MouseEvent &ev) override
     {
@@ -63,7 +80,10 @@ class MultiStepComponent : public juce::Component
     }
     void paint(juce::Graphics &g) override
     {
-        if (steps.isValid())
+        RM_TRACE_SCOPE("MultiStepComponent::paint");
+        // the analysis can be behind the steps and transforms for a moment after a change
+        const bool analyzed = analysis.request == makeAnalysisRequest();
+        if (!analyzed || analysis.valid)
             g.fillAll(juce::Colours::black);
         else
             g.fillAll(juce::Colours::red.darker());
@@ -82,15 +102,14 @@ class MultiStepComponent : public juce::Component
             g.fillRect((float)1.0 + i * stepw, steph, stepw / 2.0, getHeight() - steph);
 
             float iterstepw = stepw / 2 / num_active_voices;
-            for (int j = 0; j < num_active_voices; ++j)
+            for (int j = 0; j < num_active_voices && analyzed; ++j)
             {
                 if (i == playingsteps[j])
                     g.setColour(juce::Colours::grey);
                 else
                     g.setColour(juce::Colours::darkgrey);
-                row_iterators[j].set_position(i);
-                steph = juce::jmap<double>(row_iterators[j].next(), 0, steps.num_active_entries,
-                                           getHeight() - 2.0, 0);
+                steph = juce::jmap<double>(analysis.transformed[j][i], 0,
+                                           steps.num_active_entries, getHeight() - 2.0, 0);
                 g.fillRect((float)1.0 + i * stepw + stepw / 2.0f + iterstepw * j, steph, iterstepw,
                            getHeight() - steph);
             }
@@ -108,6 +127,8 @@ class MultiStepComponent : public juce::Component
     int num_active_voices = 1;
 
   private:
+    RowAnalysisQueue::Client analysisClient;
+    RowAnalysis analysis;
     int draggingIndex = -1;
     int dragystart = 0;
     int stepstart = 0;
@@ -120,6 +141,7 @@ class RowComponent : public juce::Component
         : toproc_fifo(fifo)
     {
         rowid = rowId;
+        rowName = name;
         infoLabel.setText(name, juce::dontSendNotification);
         infoLabel.setColour(juce::Label::textColourId, juce::Colours::black);
         addAndMakeVisible(infoLabel);
@@ -176,11 +198,12 @@ class RowComponent : public juce::Component
                                       curtransform.reversed == transform.rev;
                         voicemenu.addItem(transform.text + " " + juce::String(i), true, ticked,
                                           [this, transform, i, j]() {
+                                              RowTransform t{i, transform.inv, transform.rev};
                                               stepComponent.row_iterators[j] =
-                                                  Row::Iterator(stepComponent.steps,
-                                                                {i, transform.inv, transform.rev});
-                                              if (OnEdited)
-                                                  OnEdited(rowid);
+                                                  Row::Iterator(stepComponent.steps, t);
+                                              stepComponent.repaint();
+                                              if (OnTransformChosen)
+                                                  OnTransformChosen(j, t);
                                           });
                     }
                 }
@@ -188,6 +211,38 @@ class RowComponent : public juce::Component
             }
             menu.showMenuAsync(juce::PopupMenu::Options{});
         };
+        addAndMakeVisible(playlistButton);
+        playlistButton.setButtonText("Playlist...");
+        playlistButton.onClick = [this]() {
+            juce::PopupMenu menu;
+            menu.addItem("Load...", [this]() {
+                fileChooser = std::make_unique<juce::FileChooser>("Load row playlist",
+                                                                  juce::File{}, "*.txt");
+                fileChooser->launchAsync(juce::FileBrowserComponent::openMode |
+                                             juce::FileBrowserComponent::canSelectFiles,
+                                         [this](const juce::FileChooser &chooser) {
+                                             auto file = chooser.getResult();
+                                             if (file.existsAsFile() && OnPlaylistChosen)
+                                                 OnPlaylistChosen(rowid, file);
+                                         });
+            });
+            menu.addItem("Clear", [this]() {
+                if (OnPlaylistChosen)
+                    OnPlaylistChosen(rowid, juce::File{});
+            });
+            menu.showMenuAsync(juce::PopupMenu::Options{});
+        };
+    }
+    // Shows a row the engine switched to by itself, playlistIndex is -1 for rows that didn't
+    // come from the playlist
+    void setRow(const Row &row, int playlistIndex)
+    {
+        stepComponent.steps = row;
+        baseCombo.setSelectedId(row.num_active_entries, juce::dontSendNotification);
+        if (playlistIndex >= 0)
+            infoLabel.setText(rowName + " (playlist row " + juce::String(playlistIndex + 1) + ")",
+                              juce::dontSendNotification);
+        stepComponent.repaint();
     }
     void resized() override
     {
@@ -195,21 +250,29 @@ class RowComponent : public juce::Component
         stepComponent.setBounds(0, 25, getWidth(), getHeight() - 50);
         baseCombo.setBounds(1, stepComponent.getBottom() + 1, 60, 24);
         menuButton.setBounds(baseCombo.getRight() + 1, stepComponent.getBottom() + 1, 100, 24);
+        playlistButton.setBounds(getWidth() - 101, stepComponent.getBottom() + 1, 100, 24);
     }
     void paint(juce::Graphics &g) override { g.fillAll(juce::Colours::orange); }
     size_t rowid = 0;
     std::function<void(size_t)> OnEdited;
+    std::function<void(size_t, RowTransform)> OnTransformChosen;
+    // called with an empty file when the playlist should be cleared
+    std::function<void(size_t, juce::File)> OnPlaylistChosen;
     toproc_fifo_t &toproc_fifo;
+    juce::String rowName;
     juce::Label infoLabel;
     juce::ComboBox baseCombo;
     juce::TextButton menuButton;
+    juce::TextButton playlistButton;
+    std::unique_ptr<juce::FileChooser> fileChooser;
     MultiStepComponent stepComponent;
 };
 
 class VelocityRowComponent : public RowComponent
 {
   public:
-    VelocityRowComponent(juce::String name, size_t rowId, Row initialRow, toproc_fifo_t &fifo)
+    VelocityRowComponent(juce::String name, size_t rowId, Row initialRow, toproc_fifo_t &fifo,
+                         juce::RangedAudioParameter &velLowParameter)
         : RowComponent(name, rowId, initialRow, fifo)
     {
         addAndMakeVisible(velLowSlider);
@@ -217,19 +280,13 @@ class VelocityRowComponent : public RowComponent
         velLowSlider.setNumDecimalPlacesToDisplay(0);
         velLowSlider.setTextBoxStyle(juce::Slider::TextEntryBoxPosition::TextBoxLeft, false, 30,
                                      24);
-        velLowSlider.setRange(0, 127, 1);
         // velLowSlider.setIncDecButtonsMode
-        velLowSlider.setValue(64, juce::dontSendNotification);
-        velLowSlider.onValueChange = [this]() {
-            MessageToProcessor msg;
-            msg.opcode = MessageToProcessor::OP_ChangeIntParameter;
-            msg.par_index = 1;
-            msg.par_ivalue = velLowSlider.getValue();
-            toproc_fifo.push(msg);
-        };
+        velLowAttachment =
+            std::make_unique<juce::SliderParameterAttachment>(velLowParameter, velLowSlider);
     }
     juce::Slider velLowSlider;
     juce::Slider velCurveSlider;
+    std::unique_ptr<juce::SliderParameterAttachment> velLowAttachment;
     void resized() override
     {
         RowComponent::resized();
@@ -237,6 +294,40 @@ class VelocityRowComponent : public RowComponent
     }
 };
 
+// Editor of a row dimension added at runtime. These don't have transforms or playlists.
+class DimensionRowComponent : public juce::Component
+{
+  public:
+    DimensionRowComponent(juce::String name, Row initialRow)
+    {
+        infoLabel.setText(name, juce::dontSendNotification);
+        infoLabel.setColour(juce::Label::textColourId, juce::Colours::black);
+        addAndMakeVisible(infoLabel);
+        addAndMakeVisible(removeButton);
+        removeButton.setButtonText("Remove");
+        removeButton.onClick = [this]() {
+            if (OnRemove)
+                OnRemove();
+        };
+        stepComponent.readonly = false;
+        stepComponent.steps = initialRow;
+        for (size_t i = 0; i < max_poly_voices; ++i)
+            stepComponent.row_iterators[i] = Row::Iterator(stepComponent.steps, RowTransform{});
+        addAndMakeVisible(stepComponent);
+    }
+    void resized() override
+    {
+        infoLabel.setBounds(0, 0, 120, 25);
+        removeButton.setBounds(1, 26, 100, 24);
+        stepComponent.setBounds(121, 0, getWidth() - 121, getHeight());
+    }
+    void paint(juce::Graphics &g) override { g.fillAll(juce::Colours::lightblue); }
+    std::function<void()> OnRemove;
+    juce::Label infoLabel;
+    juce::TextButton removeButton;
+    MultiStepComponent stepComponent;
+};
+
 class AudioPluginAudioProcessorEditor final : public juce::AudioProcessorEditor,
                                               public juce::MidiKeyboardStateListener,
                                               public juce::Timer
@@ -259,9 +350,23 @@ class AudioPluginAudioProcessorEditor final : public juce::AudioProcessorEditor,
   private:
     AudioPluginAudioProcessor &processorRef;
     std::vector<std::unique_ptr<RowComponent>> rowComponents;
-    
+    std::vector<std::unique_ptr<DimensionRowComponent>> dimensionComponents;
+    juce::TextButton addDimensionButton;
+    void addDimensionComponent(size_t index);
+    void updateEditorSize();
+
     juce::ToggleButton selfSequenceToggle;
+    std::unique_ptr<juce::ButtonParameterAttachment> selfSequenceAttachment;
+    juce::ToggleButton recordSessionToggle;
+    juce::Slider clockGroupSlider;
+    std::unique_ptr<juce::SliderParameterAttachment> clockGroupAttachment;
+#if ROWMANAGER_TRACING
+    juce::TextButton writeTraceButton;
+#endif
     juce::Label debugLabel;
+    std::array<uint32_t, max_poly_voices> shownTriggerCounts{};
+    // the transform parameter values last shown, -1 before the first update
+    std::array<std::array<int, max_poly_voices>, RID_LAST> shownTransformParameters;
     bool rowValid = false;
     juce::MidiKeyboardComponent keyboardComponent;
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(AudioPluginAudioProcessorEditor)
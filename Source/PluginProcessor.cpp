@@ -5,44 +5,154 @@
 #include "row_engine.h"
 
 //==============================================================================
-AudioPluginAudioProcessor::AudioPluginAudioProcessor()
-    : AudioProcessor(BusesProperties()
-#if !JucePlugin_IsMidiEffect
-#if !JucePlugin_IsSynth
-                         .withInput("Input", juce::AudioChannelSet::stereo(), true)
-#endif
-                         .withOutput("Output", juce::AudioChannelSet::stereo(), true)
-#endif
-      )
+void ProcessorParameters::addTo(juce::AudioProcessor &proc)
 {
-    pending_rows.reserve(64);
-    fifo_to_ui.reset(1024);
-    fifo_to_processor.reset(1024);
-    rows[RID_PITCHCLASS] = Row::make_all_interval(12);
-    // rows[RID_PITCHCLASS].num_active_entries = 12;
-    // for (int i = 0; i < 12; ++i)
-    //     rows[RID_PITCHCLASS].entries[i] = (i * 7) % 12;
-    rows[RID_DELTATIME] = Row::make_from_init_list({4, 3, 2, 0, 1});
-    rows[RID_OCTAVE] = Row::make_from_init_list({3, 2, 1, 0});
-    rows[RID_VELOCITY] = Row::make_from_init_list({2, 3, 0, 1});
-    rows[RID_POLYAT] = Row::make_from_init_list({2, 3, 0, 1, 5, 4});
-    rowRepeats = {1, 1, 1, 1};
-    for (size_t i = 0; i < max_poly_voices; ++i)
+    const EngineParameters defaults;
+    const char *rowids[RID_LAST] = {"pitchclass", "deltatime", "velocity", "octave", "polyat"};
+    const char *rownames[RID_LAST] = {"Pitch Class", "Onset difference", "Velocity", "Octave",
+                                      "PolyAT"};
+    auto transformtotext = [](int value, int) { return transform_from_index(value).to_string(); };
+    auto addprobability = [&](size_t rid, const char *id, const char *name) {
+        auto par = new juce::AudioParameterFloat(
+            juce::ParameterID{juce::String(rowids[rid]) + "_mutate_" + id, 1},
+            juce::String(rownames[rid]) + " " + name + " probability", 0.0f, 1.0f, 0.0f);
+        proc.addParameter(par);
+        return par;
+    };
+    for (size_t rid = 0; rid < RID_LAST; ++rid)
     {
-        for (size_t j = 0; j < RID_LAST; ++j)
+        for (size_t v = 0; v < max_poly_voices; ++v)
         {
-            voices[i].rowIterators[j] = Row::Iterator(rows[j], RowTransform());
-            if (j == RID_OCTAVE)
-            {
-                voices[i].rowIterators[j].repetitions = 6;
-            }
+            transforms[rid][v] = new juce::AudioParameterInt(
+                juce::ParameterID{juce::String(rowids[rid]) + "_transform_v" + juce::String(v + 1),
+                                  1},
+                juce::String(rownames[rid]) + " transform V" + juce::String(v + 1), 0,
+                max_transform_index, transform_to_index(defaults.transforms[rid][v]),
+                juce::AudioParameterIntAttributes().withStringFromValueFunction(transformtotext));
+            proc.addParameter(transforms[rid][v]);
         }
+        rowRepeats[rid] = new juce::AudioParameterInt(
+            juce::ParameterID{juce::String(rowids[rid]) + "_repeats", 1},
+            juce::String(rownames[rid]) + " repeats", 1, 16, (int)defaults.rowRepeats[rid]);
+        proc.addParameter(rowRepeats[rid]);
+        mutateTransform[rid] = addprobability(rid, "transform", "transform change");
+        mutateRotate[rid] = addprobability(rid, "rotate", "rotation");
+        mutateSwap[rid] = addprobability(rid, "swap", "swap");
+        mutateMultiply[rid] = addprobability(rid, "multiply", "multiplication");
+    }
+    numActiveVoices = new juce::AudioParameterInt(juce::ParameterID{"voices", 1}, "Voices", 1,
+                                                  (int)max_poly_voices,
+                                                  (int)defaults.numActiveVoices);
+    proc.addParameter(numActiveVoices);
+    velocityLow = new juce::AudioParameterInt(juce::ParameterID{"velocity_low", 1},
+                                              "Velocity low", 0, 127, defaults.velocityLow);
+    proc.addParameter(velocityLow);
+    selfSequence = new juce::AudioParameterBool(juce::ParameterID{"self_sequence", 1},
+                                                "Self sequence", defaults.selfSequence);
+    proc.addParameter(selfSequence);
+    sharedClockGroup = new juce::AudioParameterInt(juce::ParameterID{"shared_clock_group", 1},
+                                                   "Shared clock group", 0,
+                                                   max_shared_clock_groups, 0);
+    proc.addParameter(sharedClockGroup);
+}
+
+EngineParameters ProcessorParameters::read() const
+{
+    EngineParameters result;
+    for (size_t rid = 0; rid < RID_LAST; ++rid)
+    {
+        for (size_t v = 0; v < max_poly_voices; ++v)
+            result.transforms[rid][v] = transform_from_index(transforms[rid][v]->get());
+        result.rowRepeats[rid] = rowRepeats[rid]->get();
+        auto &ms = result.mutations[rid];
+        ms.newTransform = mutateTransform[rid]->get();
+        ms.rotate = mutateRotate[rid]->get();
+        ms.swapPair = mutateSwap[rid]->get();
+        ms.multiply = mutateMultiply[rid]->get();
     }
+    result.numActiveVoices = numActiveVoices->get();
+    result.velocityLow = velocityLow->get();
+    result.selfSequence = selfSequence->get();
+    return result;
+}
+
+// Appends the events, which must be sorted by offset and come after the events already in the
+// buffer, in one pass. MidiBuffer::addEvent searches the insert position from the start of the
+// buffer for each event, so the raw data is written directly instead, in JUCE's layout of
+// int32 sample position, uint16 size and the MIDI bytes. The layout isn't public API, so debug
+// builds read the appended events back through the iterator.
+static void append_sorted_events(std::span<const SequencerEvent> events, juce::MidiBuffer &buf)
+{
+#if JUCE_DEBUG
+    const int numEventsBefore = buf.getNumEvents();
+#endif
+    uint8_t bytes[sizeof(int32_t) + sizeof(uint16_t) + 3];
+    const uint16_t size = 3;
+    std::memcpy(bytes + sizeof(int32_t), &size, sizeof(uint16_t));
+    for (const auto &ev : events)
+    {
+        const int32_t pos = (int32_t)ev.offset;
+        std::memcpy(bytes, &pos, sizeof(int32_t));
+        bytes[6] = midi_status(ev);
+        bytes[7] = ev.note & 0x7f;
+        bytes[8] = ev.velocity & 0x7f;
+        buf.data.addArray(bytes, (int)sizeof(bytes));
+    }
+#if JUCE_DEBUG
+    int index = 0;
+    for (const auto metadata : buf)
+    {
+        if (index >= numEventsBefore)
+        {
+            const auto &ev = events[(size_t)(index - numEventsBefore)];
+            jassert(metadata.samplePosition == (int)ev.offset && metadata.numBytes == 3);
+            jassert(metadata.data[0] == midi_status(ev) && metadata.data[1] == ev.note);
+        }
+        ++index;
+    }
+    jassert(index == numEventsBefore + (int)events.size());
+#endif
+}
+
+static bool is_standalone()
+{
+    return juce::PluginHostType::getPluginLoadedAs() ==
+           juce::AudioProcessor::wrapperType_Standalone;
+}
 
-    playingNotes.reserve(1024);
+// A MIDI effect has no audio buses, except in the standalone app, where the audio device
+// callback is what drives the processing
+static juce::AudioProcessor::BusesProperties make_buses_properties()
+{
+    juce::AudioProcessor::BusesProperties buses;
+#if JucePlugin_IsMidiEffect
+    if (is_standalone())
+        buses = buses.withOutput("Output", juce::AudioChannelSet::stereo(), true);
+#else
+#if !JucePlugin_IsSynth
+    buses = buses.withInput("Input", juce::AudioChannelSet::stereo(), true);
+#endif
+    buses = buses.withOutput("Output", juce::AudioChannelSet::stereo(), true);
+#endif
+    return buses;
 }
 
-AudioPluginAudioProcessor::~AudioPluginAudioProcessor() {}
+//==============================================================================
+AudioPluginAudioProcessor::AudioPluginAudioProcessor() : AudioProcessor(make_buses_properties())
+{
+    parameters.addTo(*this);
+    pending_rows.reserve(64);
+    fifo_to_processor.reset(1024);
+    generatedMessages.ensureSize(8192);
+    RM_TRACE_INIT();
+    startTimer(50);
+}
+
+AudioPluginAudioProcessor::~AudioPluginAudioProcessor()
+{
+    stopTimer();
+    sessionRecorder.stop();
+}
 
 //==============================================================================
 const juce::String AudioPluginAudioProcessor::getName() const { return JucePlugin_Name; }
@@ -91,9 +201,9 @@ void AudioPluginAudioProcessor::changeProgramName(int index, const juce::String
 }
 
 //==============================================================================
-void AudioPluginAudioProcessor::prepareToPlay(double /*sampleRate*/, int /*samplesPerBlock*/)
+void AudioPluginAudioProcessor::prepareToPlay(double sampleRate, int /*samplesPerBlock*/)
 {
-    send_ui_updates = true;
+    engine.prepare(sampleRate);
 }
 
 void AudioPluginAudioProcessor::releaseResources() {}
@@ -101,8 +211,12 @@ void AudioPluginAudioProcessor::releaseResources() {}
 bool AudioPluginAudioProcessor::isBusesLayoutSupported(const BusesLayout &layouts) const
 {
 #if JucePlugin_IsMidiEffect
-    juce::ignoreUnused(layouts);
-    return true;
+    if (!layouts.getMainInputChannelSet().isDisabled())
+        return false;
+    if (is_standalone())
+        return layouts.getMainOutputChannelSet() == juce::AudioChannelSet::mono() ||
+               layouts.getMainOutputChannelSet() == juce::AudioChannelSet::stereo();
+    return layouts.getMainOutputChannelSet().isDisabled();
 #else
     // This is the place where you check if the layout is supported.
     // In this template code we only support mono or stereo.
@@ -125,154 +239,157 @@ bool AudioPluginAudioProcessor::isBusesLayoutSupported(const BusesLayout &layout
 void AudioPluginAudioProcessor::processBlock(juce::AudioBuffer<float> &buffer,
                                              juce::MidiBuffer &midiMessages)
 {
-    jassert(num_active_voices <= max_poly_voices);
     juce::ScopedNoDenormals noDenormals;
+    RM_TRACE_THREAD("audio");
+    RM_TRACE_SCOPE("processBlock");
+    TransportInfo transport;
+    int64_t hostSampleTime = -1;
     ph = getPlayHead();
     if (ph)
     {
         auto pos = ph->getPosition();
         if (pos)
         {
-            curBPM = pos->getBpm().orFallback(120.0);
-            curPPQPos = pos->getPpqPosition().orFallback(0.0);
+            transport.bpm = pos->getBpm().orFallback(120.0);
+            transport.ppqpos = pos->getPpqPosition().orFallback(0.0);
+            transport.isPlaying = pos->getIsPlaying();
+            hostSampleTime = pos->getTimeInSamples().orFallback(-1);
+            curBPM = transport.bpm;
+            curPPQPos = transport.ppqpos;
         }
     }
     generatedMessages.clear();
-    keyboardState.processNextMidiBuffer(midiMessages, 0, buffer.getNumSamples(), true);
-    std::array<int, max_poly_voices> triggerstatuses;
-    std::fill(triggerstatuses.begin(), triggerstatuses.end(), 0);
-
-    for (const juce::MidiMessageMetadata metadata : midiMessages)
-    {
-        auto msg = metadata.getMessage();
-        if (msg.isNoteOn())
-        {
-            if (msg.getNoteNumber() == 48)
-            {
-                // triggerstatus = 1;
-            }
-        }
-        if (msg.isNoteOff())
-        {
-            if (msg.getNoteNumber() == 48)
-            {
-                // triggerstatus = 3;
-            }
-        }
-    }
-    MessageToProcessor amsg;
-    while (fifo_to_processor.pop(amsg))
-    {
-        if (amsg.opcode == MessageToProcessor::OP_ChangeRow)
-        {
-            rows[amsg.row_index] = amsg.row;
+    if (keyboardStateEnabled.load(std::memory_order_relaxed))
+        keyboardState.processNextMidiBuffer(midiMessages, 0, buffer.getNumSamples(), true);
 
-            auto oldpos = voices[amsg.voice_index].rowIterators[amsg.row_index].pos;
-            voices[amsg.voice_index].rowIterators[amsg.row_index] =
-                Row::Iterator(rows[amsg.row_index], amsg.transform);
-            voices[amsg.voice_index].rowIterators[amsg.row_index].pos = oldpos;
-        }
-        if (amsg.opcode == MessageToProcessor::OP_ChangeIntParameter)
-        {
-            if (amsg.par_index == 0)
-            {
-                if (amsg.par_ivalue == 0)
-                {
-                    selfSequence = false;
-                    // triggerstatus = 3;
-                }
-                if (amsg.par_ivalue == 1)
-                {
-                    selfSequence = true;
-                }
-            }
-            if (amsg.par_index == 1)
-            {
-                velocityLow = amsg.par_ivalue;
-            }
-        }
-    }
-    for (auto &pm : playingNotes)
+    sessionRecorder.beginBlock(engine);
+    sharedClock.setGroup(engine, parameters.sharedClockGroup->get());
+    // Rows edited in the other instances of the group, recorded as if edited here
+    sharedClock.pullRows(engine, [this](size_t rid, const Row &row) {
+        MessageToProcessor msg;
+        msg.opcode = MessageToProcessor::OP_ChangeRow;
+        msg.row_index = rid;
+        msg.row = row;
+        sessionRecorder.recordMessage(msg);
+    });
     {
-        pm.duration -= buffer.getNumSamples();
-        // if (triggerstatus == 3 || pm.duration <= 0)
-        if (pm.duration <= 0)
+        RM_TRACE_SCOPE("drain fifo_to_processor");
+        MessageToProcessor amsg;
+        while (fifo_to_processor.pop(amsg))
         {
-            generatedMessages.addEvent(juce::MidiMessage::noteOff(pm.chan, pm.note, 0.0f), 0);
-            pm.chan = -1;
+            sessionRecorder.recordMessage(amsg);
+            engine.handleMessage(amsg);
+            if (amsg.opcode == MessageToProcessor::OP_ChangeRow && amsg.row_index < RID_LAST)
+                sharedClock.publishRow(amsg.row_index, engine.rows[amsg.row_index]);
         }
     }
-    if (selfSequence)
     {
-        for (int i = 0; i < buffer.getNumSamples(); ++i)
-        {
-            for (int j = 0; j < num_active_voices; ++j)
-            {
-                if (voices[j].playpos == 0)
-                {
-                    triggerstatuses[j] = 2;
-                    // noteofftriggered = true;
-                }
-                ++voices[j].playpos;
-                if (voices[j].playpos == voices[j].pulselen)
-                    voices[j].playpos = 0;
-            }
-        }
+        RM_TRACE_SCOPE("apply parameters");
+        // Read once per block, so a change applies from the first trigger of the block even
+        // when that's later than the host's automation point (see EngineParameters)
+        auto pars = parameters.read();
+        if (engine.applyParameters(pars))
+            sessionRecorder.recordParameters(pars);
     }
-    if (send_ui_updates)
+    engine.setTempo(transport.bpm);
+    sharedClock.processBlock(engine, buffer.getNumSamples(), hostSampleTime);
+    if (sharedClock.isInGroup())
     {
-        MessageToUI msg;
-        msg.opcode = MessageToUI::OP_VoiceCountChanged;
-        msg.par0 = num_active_voices;
-        fifo_to_ui.push(msg);
-        msg.opcode = MessageToUI::OP_RowTransformChanged;
-        fifo_to_ui.push(msg);
-        send_ui_updates = false;
+        sessionRecorder.recordPulseBlock(engine.lastPulseBlock);
+        for (const auto &ps : engine.playlistSwitches)
+            sharedClock.publishRow(ps.rid, ps.row.row);
     }
-    double bpm = 120.0;
-    for (size_t i = 0; i < num_active_voices; ++i)
+    sessionRecorder.endBlock(buffer.getNumSamples(), transport, engine);
+
     {
-        if (triggerstatuses[i] == 1 || triggerstatuses[i] == 2)
-        {
-            MessageToUI msg;
-            msg.opcode = MessageToUI::OP_StepPositionChanged;
-            msg.voice_index = i;
-            for (int rid = 0; rid < RID_LAST; ++rid)
-            {
-                msg.playpositions[rid] = voices[i].rowIterators[rid].pos;
-            }
-
-            int polyat = voices[i].rowIterators[RID_POLYAT].next();
-            double plen = (1 + voices[i].rowIterators[RID_DELTATIME].next());
-
-            plen = (60.0 / bpm / 4.0) * plen;
-            voices[i].pulselen = static_cast<int>(getSampleRate() * plen);
-            int octave = voices[i].rowIterators[RID_OCTAVE].next() - 3;
-            int note = 60 + octave * rows[RID_PITCHCLASS].num_active_entries +
-                       voices[i].rowIterators[RID_PITCHCLASS].next();
-            msg.soundingpitch = note;
-            fifo_to_ui.push(msg);
-            float velo =
-                juce::jmap<float>(voices[i].rowIterators[RID_VELOCITY].next(), 0,
-                                  rows[RID_VELOCITY].num_active_entries - 1, velocityLow, 127);
-            generatedMessages.addEvent(juce::MidiMessage::noteOn(1 + i, note, (juce::uint8)velo),
-                                       0);
-            int lentouse = notelen;
-            if (triggerstatuses[i] == 1)
-                lentouse = 100000000;
-            playingNotes.push_back({int(1 + i), note, lentouse});
-        }
+        RM_TRACE_SCOPE("MIDI output");
+        outputStage.clear();
+        outputStage.add(engine.outputEvents);
+        outputStage.sortByOffset();
+        append_sorted_events(outputStage.getEvents(), generatedMessages);
+        midiMessages.swapWith(generatedMessages);
     }
-    std::erase_if(playingNotes, [](const auto &t) { return t.chan == -1; });
-    midiMessages.swapWith(generatedMessages);
 
+#if JucePlugin_IsMidiEffect
+    // only the standalone app has channels, which it plays
+    if (buffer.getNumChannels() > 0)
+        buffer.clear();
+#else
+    // The audio passes through, only the extra outputs are silenced
     auto totalNumInputChannels = getTotalNumInputChannels();
     auto totalNumOutputChannels = getTotalNumOutputChannels();
 
     for (auto i = totalNumInputChannels; i < totalNumOutputChannels; ++i)
         buffer.clear(i, 0, buffer.getNumSamples());
+#endif
+}
+
+bool AudioPluginAudioProcessor::startSessionRecording(juce::File file)
+{
+    file.getParentDirectory().createDirectory();
+    return sessionRecorder.start(file.getFullPathName().toStdString());
+}
+
+void AudioPluginAudioProcessor::stopSessionRecording() { sessionRecorder.stop(); }
+
+bool AudioPluginAudioProcessor::setRowPlaylist(size_t rid, RowPlaylist playlist)
+{
+    return playlistFeeder.setPlaylist(engine, rid, std::move(playlist));
 }
 
+bool AudioPluginAudioProcessor::addRowDimension(const RowDimension &dim, const Row &row)
+{
+    if (rowDimensions.size() >= max_row_dimensions)
+        return false;
+    MessageToProcessor msg;
+    msg.opcode = MessageToProcessor::OP_SetDimension;
+    msg.row_index = rowDimensions.size();
+    msg.row = row;
+    msg.dimension = dim;
+    if (!fifo_to_processor.push(msg))
+        return false;
+    rowDimensions.push_back({dim, row});
+    return true;
+}
+
+void AudioPluginAudioProcessor::setRowDimensionRow(size_t index, const Row &row)
+{
+    if (index >= rowDimensions.size())
+        return;
+    rowDimensions[index].row = row;
+    MessageToProcessor msg;
+    msg.opcode = MessageToProcessor::OP_SetDimension;
+    msg.row_index = index;
+    msg.row = row;
+    msg.dimension = rowDimensions[index].dimension;
+    fifo_to_processor.push(msg);
+}
+
+void AudioPluginAudioProcessor::removeRowDimension(size_t index)
+{
+    if (index >= rowDimensions.size())
+        return;
+    MessageToProcessor msg;
+    msg.opcode = MessageToProcessor::OP_RemoveDimension;
+    msg.row_index = index;
+    if (fifo_to_processor.push(msg))
+        rowDimensions.erase(rowDimensions.begin() + index);
+}
+
+void AudioPluginAudioProcessor::timerCallback()
+{
+    RM_TRACE_SCOPE("playlist refill");
+    playlistFeeder.refill(engine);
+}
+
+#if ROWMANAGER_TRACING
+bool AudioPluginAudioProcessor::writeTrace(juce::File file)
+{
+    file.getParentDirectory().createDirectory();
+    return Tracer::instance().writeChromeTrace(file.getFullPathName().toStdString());
+}
+#endif
+
 //==============================================================================
 bool AudioPluginAudioProcessor::hasEditor() const
 {
@@ -281,24 +398,37 @@ bool AudioPluginAudioProcessor::hasEditor() const
 
 juce::AudioProcessorEditor *AudioPluginAudioProcessor::createEditor()
 {
-    send_ui_updates = true;
+    engine.send_ui_updates = true;
     return new AudioPluginAudioProcessorEditor(*this);
 }
 
 //==============================================================================
+// The parameter values are stored by parameter ID, so that parameters added later keep their
+// defaults when an older state is loaded
 void AudioPluginAudioProcessor::getStateInformation(juce::MemoryBlock &destData)
 {
-    // You should use this method to store your parameters in the memory block.
-    // You could do that either as raw data, or use the XML or ValueTree classes
-    // as intermediaries to make it easy to save and load complex data.
-    juce::ignoreUnused(destData);
+    juce::XmlElement xml("RowManagerState");
+    for (auto *p : getParameters())
+    {
+        if (auto *rp = dynamic_cast<juce::RangedAudioParameter *>(p))
+            xml.setAttribute(rp->getParameterID(), rp->convertFrom0to1(rp->getValue()));
+    }
+    copyXmlToBinary(xml, destData);
 }
 
 void AudioPluginAudioProcessor::setStateInformation(const void *data, int sizeInBytes)
 {
-    // You should use this method to restore your parameters from this memory block,
-    // whose contents will have been created by the getStateInformation() call.
-    juce::ignoreUnused(data, sizeInBytes);
+    auto xml = getXmlFromBinary(data, sizeInBytes);
+    if (!xml || !xml->hasTagName("RowManagerState"))
+        return;
+    for (auto *p : getParameters())
+    {
+        auto *rp = dynamic_cast<juce::RangedAudioParameter *>(p);
+        if (!rp || !xml->hasAttribute(rp->getParameterID()))
+            continue;
+        float value = (float)xml->getDoubleAttribute(rp->getParameterID());
+        rp->setValueNotifyingHost(rp->convertTo0to1(value));
+    }
 }
 
 //==============================================================================
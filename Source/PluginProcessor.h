@@ -5,59 +5,35 @@
 #include "juce_audio_basics/juce_audio_basics.h"
 #include "juce_core/juce_core.h"
 #include "row_engine.h"
-#include "containers/choc_SingleReaderSingleWriterFIFO.h"
+#include "sequencer_engine.h"
+#include "session_log.h"
+#include "row_playlist.h"
+#include "shared_clock.h"
+#include "event_stage.h"
 
 using namespace xenakios;
 
-constexpr size_t max_poly_voices = 4;
-
-struct Voice
-{
-    std::array<Row::Iterator, RID_LAST> rowIterators;
-    int playpos = 0;
-    int pulselen = 11025;
-    int notelen = 11025;
-    int outchan = 0;
-};
-
-struct MessageToUI
+// The plugin parameters, created with the defaults of EngineParameters. The values live in the
+// atomics of the JUCE parameters, read() gathers them all for the audio thread in one pass.
+struct ProcessorParameters
 {
-    enum Op
-    {
-        OP_None,
-        OP_StepPositionChanged,
-        OP_VoiceCountChanged,
-        OP_RowTransformChanged
-    };
-    Op opcode = OP_None;
-    RowTransform transform;
-    int par0 = 0;
-    int voice_index = 0;
-    int soundingpitch = 0;
-    std::array<int16_t, RID_LAST> playpositions;
-};
-
-struct MessageToProcessor
-{
-    enum Op
-    {
-        OP_None,
-        OP_ChangeRow,
-        OP_ChangeTransform,
-        OP_ChangeIntParameter
-    };
-    Op opcode = OP_None;
-    int voice_index = 0;
-    int par_index = 0;
-    int par_ivalue = 0;
-    uint16_t row_index = 0;
-    Row row;
-    RowTransform transform;
+    void addTo(juce::AudioProcessor &proc);
+    EngineParameters read() const;
+    std::array<std::array<juce::AudioParameterInt *, max_poly_voices>, RID_LAST> transforms{};
+    std::array<juce::AudioParameterInt *, RID_LAST> rowRepeats{};
+    // the probabilities of the RowMutationSettings
+    std::array<juce::AudioParameterFloat *, RID_LAST> mutateTransform{};
+    std::array<juce::AudioParameterFloat *, RID_LAST> mutateRotate{};
+    std::array<juce::AudioParameterFloat *, RID_LAST> mutateSwap{};
+    std::array<juce::AudioParameterFloat *, RID_LAST> mutateMultiply{};
+    juce::AudioParameterInt *numActiveVoices = nullptr;
+    juce::AudioParameterInt *velocityLow = nullptr;
+    juce::AudioParameterBool *selfSequence = nullptr;
+    // not part of EngineParameters, as it's handled by the processor's SharedClockClient
+    juce::AudioParameterInt *sharedClockGroup = nullptr;
 };
 
-using toproc_fifo_t = choc::fifo::SingleReaderSingleWriterFIFO<MessageToProcessor>;
-
-class AudioPluginAudioProcessor final : public juce::AudioProcessor
+class AudioPluginAudioProcessor final : public juce::AudioProcessor, private juce::Timer
 {
   public:
     AudioPluginAudioProcessor();
@@ -93,8 +69,6 @@ class AudioPluginAudioProcessor final : public juce::AudioProcessor
     //==============================================================================
     void getStateInformation(juce::MemoryBlock &destData) override;
     void setStateInformation(const void *data, int sizeInBytes) override;
-    std::array<Row, RID_LAST> rows;
-    std::array<size_t, RID_LAST> rowRepeats;
     juce::AudioPlayHead *ph = nullptr;
     std::atomic<double> curBPM{120.0};
     std::atomic<double> curPPQPos{0.0};
@@ -104,29 +78,52 @@ class AudioPluginAudioProcessor final : public juce::AudioProcessor
         Row row;
         RowTransform transform;
     };
-    std::array<Voice, max_poly_voices> voices;
-    size_t num_active_voices = 2;
     std::vector<PendingRowInfo> pending_rows;
     juce::MidiKeyboardState keyboardState;
-    std::atomic<bool> send_ui_updates{false};
-    int velocityLow = 64;
-    struct NoteInfo
-    {
-        int chan = 0;
-        int note = 0;
-        int duration = 0;
-    };
-    std::vector<NoteInfo> playingNotes;
+    // Set while the editor shows the keyboard, which is the only user of keyboardState
+    std::atomic<bool> keyboardStateEnabled{false};
     juce::MidiBuffer generatedMessages;
-    
-    int notelen = 11025;
-    choc::fifo::SingleReaderSingleWriterFIFO<MessageToUI> fifo_to_ui;
+    // The block's output events, sorted before they're written to the host buffer
+    EventStage outputStage;
+
+    SequencerEngine engine;
+    ProcessorParameters parameters;
 
     toproc_fifo_t fifo_to_processor;
 
-    std::atomic<bool> selfSequence{true};
+    // Optional recording of the UI messages and transport for deterministic replay
+    bool startSessionRecording(juce::File file);
+    void stopSessionRecording();
+    SessionRecorder sessionRecorder;
+
+    // Message thread. The rows are prepared ahead by the timer, so the engine only needs to
+    // pick up the next one at the row cycle boundaries.
+    bool setRowPlaylist(size_t rid, RowPlaylist playlist);
+    RowPlaylistFeeder playlistFeeder;
+
+    // Message thread. The row dimensions added at runtime, as last sent to the engine, so that
+    // the editor can show them when it's reopened.
+    struct RowDimensionState
+    {
+        RowDimension dimension;
+        Row row;
+    };
+    std::vector<RowDimensionState> rowDimensions;
+    bool addRowDimension(const RowDimension &dim, const Row &row);
+    void setRowDimensionRow(size_t index, const Row &row);
+    void removeRowDimension(size_t index);
+
+    // Instances in the same group share the voice timing and rows, for sample locked canons
+    // between instances with their own transforms and sounds
+    SharedClockClient sharedClock;
+
+#if ROWMANAGER_TRACING
+    // Writes the recent audio and UI thread activity as Chrome trace JSON
+    bool writeTrace(juce::File file);
+#endif
 
   private:
+    void timerCallback() override;
     //==============================================================================
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(AudioPluginAudioProcessor)
 };
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+#include "sequencer_engine.h"
+
+namespace xenakios
+{
+
+// Fixed capacity staging area for the events of one block. The events are gathered unsorted,
+// then sorted by sample offset with a stable radix sort, so events at the same offset stay in
+// the order they were added, like the note offs the engine emits before the note ons. The
+// memory is allocated by reset, adding and sorting never allocate.
+class EventStage
+{
+  public:
+    EventStage() { reset(4096); }
+    // Not realtime safe
+    void reset(size_t capacity)
+    {
+        events.resize(capacity);
+        scratch.resize(capacity);
+        numEvents = 0;
+    }
+    void clear() { numEvents = 0; }
+    // Returns false and counts the event as dropped if the stage is full
+    bool add(const SequencerEvent &ev)
+    {
+        if (numEvents == events.size())
+        {
+            ++droppedEvents;
+            return false;
+        }
+        events[numEvents++] = ev;
+        return true;
+    }
+    void add(std::span<const SequencerEvent> evs)
+    {
+        for (const auto &ev : evs)
+            add(ev);
+    }
+    // Least significant digit first radix sort on the offset bytes. Digits that are the same for
+    // all the events are skipped, so block relative offsets usually take one or two passes.
+    void sortByOffset()
+    {
+        if (numEvents < 2)
+            return;
+        SequencerEvent *src = events.data();
+        SequencerEvent *dst = scratch.data();
+        for (int shift = 0; shift < 32; shift += 8)
+        {
+            std::array<uint32_t, 256> counts{};
+            for (size_t i = 0; i < numEvents; ++i)
+                ++counts[(src[i].offset >> shift) & 0xff];
+            if (counts[(src[0].offset >> shift) & 0xff] == numEvents)
+                continue;
+            uint32_t total = 0;
+            for (auto &c : counts)
+            {
+                uint32_t n = c;
+                c = total;
+                total += n;
+            }
+            for (size_t i = 0; i < numEvents; ++i)
+                dst[counts[(src[i].offset >> shift) & 0xff]++] = src[i];
+            std::swap(src, dst);
+        }
+        if (src != events.data())
+            std::copy(src, src + numEvents, events.data());
+    }
+    std::span<const SequencerEvent> getEvents() const { return {events.data(), numEvents}; }
+    size_t size() const { return numEvents; }
+    uint64_t getNumDroppedEvents() const { return droppedEvents; }
+
+  private:
+    std::vector<SequencerEvent> events;
+    std::vector<SequencerEvent> scratch;
+    size_t numEvents = 0;
+    uint64_t droppedEvents = 0;
+};
+
+} // namespace xenakios
@@ -0,0 +1,246 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <initializer_list>
+#include <span>
+#include <vector>
+#include "sequencer_engine.h"
+#include "ump_output.h"
+
+namespace xenakios
+{
+
+// Writes a single track (format 0) Standard MIDI File. The track data is encoded as the events
+// are added, so only the final byte stream is kept in memory.
+class MidiFileWriter
+{
+  public:
+    MidiFileWriter(int ticksPerQuarter, double bpm) : tpq(ticksPerQuarter)
+    {
+        trackData.reserve(65536);
+        uint32_t usPerQuarter = uint32_t(60000000.0 / bpm);
+        writeVarLen(0);
+        trackData.insert(trackData.end(), {0xff, 0x51, 0x03});
+        trackData.push_back(uint8_t(usPerQuarter >> 16));
+        trackData.push_back(uint8_t(usPerQuarter >> 8));
+        trackData.push_back(uint8_t(usPerQuarter));
+    }
+    // Events must be added in non decreasing tick order
+    void addEvent(uint64_t tick, const SequencerEvent &ev)
+    {
+        writeVarLen(tick - lastTick);
+        lastTick = tick;
+        trackData.push_back(midi_status(ev));
+        trackData.push_back(ev.note & 0x7f);
+        trackData.push_back(ev.velocity & 0x7f);
+    }
+    bool write(const std::filesystem::path &path, uint64_t endTick)
+    {
+        writeVarLen(endTick > lastTick ? endTick - lastTick : 0);
+        trackData.insert(trackData.end(), {0xff, 0x2f, 0x00});
+        std::ofstream os(path, std::ios::binary);
+        if (!os.is_open())
+            return false;
+        std::vector<uint8_t> header{'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1};
+        header.push_back(uint8_t(tpq >> 8));
+        header.push_back(uint8_t(tpq));
+        header.insert(header.end(), {'M', 'T', 'r', 'k'});
+        uint32_t len = trackData.size();
+        for (int i = 3; i >= 0; --i)
+            header.push_back(uint8_t(len >> (i * 8)));
+        os.write((const char *)header.data(), header.size());
+        os.write((const char *)trackData.data(), trackData.size());
+        return os.good();
+    }
+    int getTicksPerQuarter() const { return tpq; }
+
+  private:
+    void writeVarLen(uint64_t v)
+    {
+        uint8_t bytes[5];
+        int n = 0;
+        bytes[n++] = v & 0x7f;
+        while ((v >>= 7) > 0 && n < 5)
+            bytes[n++] = 0x80 | (v & 0x7f);
+        while (n > 0)
+            trackData.push_back(bytes[--n]);
+    }
+    int tpq = 960;
+    uint64_t lastTick = 0;
+    std::vector<uint8_t> trackData;
+};
+
+// Writes a MIDI 2.0 Clip File, which keeps the full resolution of the note ons. The file is the
+// "SMF2CLIP" header followed by Universal MIDI Packets with big endian words, each packet
+// preceded by a Delta Clockstamp in ticks. The header sets the ticks per quarter note, and the
+// clip starts with a tempo.
+class Midi2ClipWriter
+{
+  public:
+    Midi2ClipWriter(int ticksPerQuarter, double bpm) : tpq(ticksPerQuarter)
+    {
+        fileData.reserve(65536);
+        fileData.insert(fileData.end(), {'S', 'M', 'F', '2', 'C', 'L', 'I', 'P'});
+        writeDelta(0);
+        writeWord(0x00300000 | uint32_t(tpq & 0xffff));
+        // Start of Clip, then a Flex Data Set Tempo in 10 nanosecond units per quarter note
+        writeDelta(0);
+        writeWords({0xf0200000, 0, 0, 0});
+        writeDelta(0);
+        writeWords({0xd0100000, uint32_t(6.0e9 / bpm), 0, 0});
+    }
+    // Packets must be added in non decreasing tick order
+    void addPacket(uint64_t tick, const UmpPacket &packet)
+    {
+        writeDelta(tick - lastTick);
+        lastTick = tick;
+        writeWords({packet.words[0], packet.words[1]});
+    }
+    bool write(const std::filesystem::path &path, uint64_t endTick)
+    {
+        writeDelta(endTick > lastTick ? endTick - lastTick : 0);
+        // End of Clip
+        writeWords({0xf0210000, 0, 0, 0});
+        std::ofstream os(path, std::ios::binary);
+        if (!os.is_open())
+            return false;
+        os.write((const char *)fileData.data(), fileData.size());
+        return os.good();
+    }
+    int getTicksPerQuarter() const { return tpq; }
+
+  private:
+    // A Delta Clockstamp holds 20 bits, longer gaps are filled with No Op messages
+    void writeDelta(uint64_t ticks)
+    {
+        constexpr uint64_t maxDelta = 0xfffff;
+        while (ticks > maxDelta)
+        {
+            writeWord(0x00400000 | uint32_t(maxDelta));
+            writeWord(0x00000000);
+            ticks -= maxDelta;
+        }
+        writeWord(0x00400000 | uint32_t(ticks));
+    }
+    void writeWords(std::initializer_list<uint32_t> words)
+    {
+        for (auto w : words)
+            writeWord(w);
+    }
+    void writeWord(uint32_t w)
+    {
+        for (int i = 3; i >= 0; --i)
+            fileData.push_back(uint8_t(w >> (i * 8)));
+    }
+    int tpq = 960;
+    uint64_t lastTick = 0;
+    std::vector<uint8_t> fileData;
+};
+
+// Zero copy reader of Standard MIDI Files. The tracks are views into the file data, which must
+// outlive the reader, and their events are only decoded when iterated. All reads are bounds
+// checked, so arbitrary files can be fed to it.
+class MidiFileReader
+{
+  public:
+    bool parse(std::span<const uint8_t> data)
+    {
+        tracks.clear();
+        if (data.size() < 14 || std::memcmp(data.data(), "MThd", 4) != 0)
+            return false;
+        uint32_t headerlen = read_u32(data.data() + 4);
+        if (headerlen < 6 || headerlen > data.size() - 8)
+            return false;
+        format = read_u16(data.data() + 8);
+        division = read_u16(data.data() + 12);
+        size_t pos = 8 + headerlen;
+        while (data.size() - pos >= 8)
+        {
+            uint32_t len = read_u32(data.data() + pos + 4);
+            bool istrack = std::memcmp(data.data() + pos, "MTrk", 4) == 0;
+            pos += 8;
+            // some files have a wrong length in the last chunk, use what's there
+            len = (uint32_t)std::min<size_t>(len, data.size() - pos);
+            if (istrack)
+                tracks.push_back(data.subspan(pos, len));
+            pos += len;
+        }
+        return !tracks.empty();
+    }
+    // Calls onNoteOn(tick, channel 1..16, note, velocity) for the note ons of a track, in file
+    // order. Returns false if the track ends in the middle of an event.
+    template <typename Callback>
+    static bool forEachNoteOn(std::span<const uint8_t> track, Callback &&onNoteOn)
+    {
+        const uint8_t *p = track.data();
+        const uint8_t *end = p + track.size();
+        uint64_t tick = 0;
+        uint8_t status = 0;
+        while (p < end)
+        {
+            uint64_t delta = 0;
+            if (!read_varlen(p, end, delta))
+                return false;
+            tick += delta;
+            if (p == end)
+                return false;
+            if (*p >= 0x80)
+                status = *p++;
+            if (status == 0xff || status == 0xf0 || status == 0xf7)
+            {
+                // meta events and sysex cancel the running status
+                if (status == 0xff && p++ == end)
+                    return false;
+                uint64_t len = 0;
+                if (!read_varlen(p, end, len) || len > uint64_t(end - p))
+                    return false;
+                p += len;
+                status = 0;
+                continue;
+            }
+            if (status < 0x80)
+                return false;
+            const uint8_t kind = status & 0xf0;
+            const int numdata = (kind == 0xc0 || kind == 0xd0) ? 1 : 2;
+            if (end - p < numdata)
+                return false;
+            if (kind == 0x90 && p[1] > 0)
+                onNoteOn(tick, (status & 0x0f) + 1, p[0] & 0x7f, p[1] & 0x7f);
+            p += numdata;
+        }
+        return true;
+    }
+    int getFormat() const { return format; }
+    // Ticks per quarter note, or SMPTE timing if the high bit is set
+    int getDivision() const { return division; }
+    std::vector<std::span<const uint8_t>> tracks;
+
+  private:
+    static uint32_t read_u32(const uint8_t *p)
+    {
+        return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+    }
+    static uint16_t read_u16(const uint8_t *p) { return uint16_t((p[0] << 8) | p[1]); }
+    static bool read_varlen(const uint8_t *&p, const uint8_t *end, uint64_t &result)
+    {
+        result = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            if (p == end)
+                return false;
+            uint8_t b = *p++;
+            result = (result << 7) | (b & 0x7f);
+            if ((b & 0x80) == 0)
+                return true;
+        }
+        return false;
+    }
+    int format = 0;
+    int division = 0;
+};
+
+} // namespace xenakios
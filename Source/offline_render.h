@@ -0,0 +1,410 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "row_engine.h"
+#include "sequencer_engine.h"
+#include "offline_synth.h"
+#include "event_stage.h"
+#include "midi_file.h"
+#include "row_playlist.h"
+#include "audio/choc_AudioFileFormat.h"
+#include "audio/choc_AudioFileFormat_WAV.h"
+
+namespace xenakios
+{
+
+// Renders the sequencer output through the offline synth into a stereo WAV file. The audio is
+// streamed to the writer in fixed size chunks, so memory use doesn't depend on the length.
+// The playlist feeder, if given, is refilled before every engine block.
+inline bool render_to_wav(SequencerEngine &engine, std::filesystem::path outpath,
+                          double lengthSeconds, RowPlaylistFeeder *feeder = nullptr)
+{
+    constexpr int chunkSize = 512;
+    constexpr int writeChunkSize = 8192;
+    choc::audio::WAVAudioFileFormat<true> wavformat;
+    choc::audio::AudioFileProperties props;
+    props.sampleRate = engine.sampleRate;
+    props.numChannels = 2;
+    props.bitDepth = choc::audio::BitDepth::float32;
+    auto writer = wavformat.createWriter(outpath, props);
+    if (!writer)
+        return false;
+    OfflineSynth synth;
+    synth.prepare(engine.sampleRate);
+    EventStage stage;
+    std::vector<float> left(writeChunkSize);
+    std::vector<float> right(writeChunkSize);
+    const float *channels[2] = {left.data(), right.data()};
+    uint64_t framesToRender = uint64_t(lengthSeconds * engine.sampleRate);
+    uint64_t framesRendered = 0;
+    while (framesRendered < framesToRender)
+    {
+        int framesInChunk = std::min<uint64_t>(writeChunkSize, framesToRender - framesRendered);
+        for (int pos = 0; pos < framesInChunk; pos += chunkSize)
+        {
+            int len = std::min(chunkSize, framesInChunk - pos);
+            if (feeder)
+                feeder->refill(engine);
+            engine.processBlock(len);
+            stage.clear();
+            stage.add(engine.outputEvents);
+            stage.sortByOffset();
+            // The synth renders up to each event's sample offset before handling it
+            int rendered = 0;
+            for (auto &ev : stage.getEvents())
+            {
+                const int offset = std::min<int>(ev.offset, len);
+                if (offset > rendered)
+                {
+                    synth.render(left.data() + pos + rendered, right.data() + pos + rendered,
+                                 offset - rendered);
+                    rendered = offset;
+                }
+                synth.handleEvent(ev);
+            }
+            if (rendered < len)
+                synth.render(left.data() + pos + rendered, right.data() + pos + rendered,
+                             len - rendered);
+        }
+        if (!writer->appendFrames(
+                choc::buffer::createChannelArrayView(channels, 2, (uint32_t)framesInChunk)))
+            return false;
+        framesRendered += framesInChunk;
+    }
+    return writer->flush();
+}
+
+// Runs the engine for the given length and writes its events into a MIDI file
+inline bool render_to_midi(SequencerEngine &engine, std::filesystem::path outpath,
+                           double lengthSeconds, RowPlaylistFeeder *feeder = nullptr)
+{
+    constexpr int blockSize = 512;
+    const double bpm = engine.bpm;
+    MidiFileWriter writer(960, bpm);
+    EventStage stage;
+    const double ticksPerSample = writer.getTicksPerQuarter() * bpm / 60.0 / engine.sampleRate;
+    uint64_t framesToRender = uint64_t(lengthSeconds * engine.sampleRate);
+    for (uint64_t pos = 0; pos < framesToRender; pos += blockSize)
+    {
+        if (feeder)
+            feeder->refill(engine);
+        engine.processBlock(std::min<uint64_t>(blockSize, framesToRender - pos));
+        // the writer needs the events in time order
+        stage.clear();
+        stage.add(engine.outputEvents);
+        stage.sortByOffset();
+        for (auto &ev : stage.getEvents())
+            writer.addEvent(uint64_t((pos + ev.offset) * ticksPerSample), ev);
+    }
+    // release whatever is still sounding at the end
+    uint64_t endtick = uint64_t(framesToRender * ticksPerSample);
+    for (auto &pn : engine.playingNotes)
+        writer.addEvent(endtick,
+                        {0, SequencerEvent::NoteOff, (uint8_t)pn.chan, (uint8_t)pn.note, 0});
+    return writer.write(outpath, endtick);
+}
+
+// Like render_to_midi, but writes the MIDI 2.0 packets of the events into a MIDI 2.0 Clip File
+inline bool render_to_midi2(SequencerEngine &engine, std::filesystem::path outpath,
+                            double lengthSeconds, RowPlaylistFeeder *feeder = nullptr)
+{
+    constexpr int blockSize = 512;
+    const double bpm = engine.bpm;
+    Midi2ClipWriter writer(960, bpm);
+    EventStage stage;
+    UmpBuffer packets;
+    const double ticksPerSample = writer.getTicksPerQuarter() * bpm / 60.0 / engine.sampleRate;
+    uint64_t framesToRender = uint64_t(lengthSeconds * engine.sampleRate);
+    for (uint64_t pos = 0; pos < framesToRender; pos += blockSize)
+    {
+        if (feeder)
+            feeder->refill(engine);
+        engine.processBlock(std::min<uint64_t>(blockSize, framesToRender - pos));
+        stage.clear();
+        stage.add(engine.outputEvents);
+        stage.sortByOffset();
+        packets.clear();
+        packets.addEvents(stage.getEvents());
+        for (auto &p : packets.getPackets())
+            writer.addPacket(uint64_t((pos + p.offset) * ticksPerSample), p);
+    }
+    uint64_t endtick = uint64_t(framesToRender * ticksPerSample);
+    stage.clear();
+    for (auto &pn : engine.playingNotes)
+        stage.add({0, SequencerEvent::NoteOff, (uint8_t)pn.chan, (uint8_t)pn.note, 0});
+    packets.clear();
+    packets.addEvents(stage.getEvents());
+    for (auto &p : packets.getPackets())
+        writer.addPacket(endtick, p);
+    return writer.write(outpath, endtick);
+}
+
+// One piece of a batch render. Unset rows keep the engine defaults.
+struct RenderJob
+{
+    std::string name;
+    double lengthSeconds = 60.0;
+    double sampleRate = 44100.0;
+    size_t numVoices = 2;
+    bool renderWav = false;
+    bool renderMidi2 = false;
+    std::array<std::optional<Row>, RID_LAST> rows;
+    std::array<std::optional<size_t>, RID_LAST> repeats;
+    // per row, one transform for each voice
+    std::array<std::vector<RowTransform>, RID_LAST> transforms;
+    std::array<RowMutationSettings, RID_LAST> mutations;
+    std::array<RowPlaylist, RID_LAST> playlists;
+    uint64_t seed = 1;
+};
+
+inline std::optional<size_t> row_id_from_name(std::string_view name)
+{
+    const char *names[RID_LAST] = {"pitch", "deltatime", "velocity", "octave", "polyat"};
+    for (size_t i = 0; i < RID_LAST; ++i)
+        if (name == names[i])
+            return i;
+    return {};
+}
+
+// Mutation probabilities are written as comma separated letter and probability pairs, t for new
+// transform, r for rotation, s for pair swap and m for multiplication, eg. t0.25,r0.1
+inline std::optional<RowMutationSettings> parse_mutation(std::string_view txt)
+{
+    RowMutationSettings ms;
+    while (!txt.empty())
+    {
+        auto comma = txt.find(',');
+        auto tok = txt.substr(0, comma);
+        float *target = nullptr;
+        if (tok.starts_with("t"))
+            target = &ms.newTransform;
+        else if (tok.starts_with("r"))
+            target = &ms.rotate;
+        else if (tok.starts_with("s"))
+            target = &ms.swapPair;
+        else if (tok.starts_with("m"))
+            target = &ms.multiply;
+        if (!target || !parse_number(tok.substr(1), *target))
+            return {};
+        if (comma == std::string_view::npos)
+            break;
+        txt.remove_prefix(comma + 1);
+    }
+    return ms;
+}
+
+// The manifest has one piece per line as whitespace separated key=value pairs, eg.
+//   name=piece1 seconds=30 voices=3 wav=1 pitch=0,11,1,10,2,9,3,8,4,7,5,6
+//   transform.pitch=P0/RI3/I5 repeats.octave=4 seed=5 mutate.pitch=t0.5,m0.1
+//   playlist.deltatime=forms/onsets.txt midi2=1
+// wav=1 and midi2=1 also render a WAV file and a MIDI 2.0 Clip File. Playlists are read from
+// files in the format of parse_playlist. Rows are named pitch, deltatime, velocity, octave and
+// polyat. Lines starting with # are comments. The names must be unique, as they name the output
+// files. Errors are reported with the line number into the error string.
+inline std::vector<RenderJob> parse_render_manifest(std::istream &is, std::string &error)
+{
+    std::vector<RenderJob> jobs;
+    std::string line;
+    int linenumber = 0;
+    while (std::getline(is, line))
+    {
+        ++linenumber;
+        std::istringstream tokens(line);
+        std::string tok;
+        RenderJob job;
+        job.name = std::format("piece{:05}", jobs.size());
+        bool empty = true;
+        while (tokens >> tok)
+        {
+            if (tok.starts_with("#"))
+                break;
+            empty = false;
+            auto eq = tok.find('=');
+            if (eq == std::string::npos)
+            {
+                error = std::format("line {} : expected key=value, got {}", linenumber, tok);
+                return {};
+            }
+            std::string_view key{tok.data(), eq};
+            std::string_view value{tok.data() + eq + 1, tok.size() - eq - 1};
+            bool ok = true;
+            if (key == "name")
+                job.name = value;
+            else if (key == "seconds")
+                ok = parse_number(value, job.lengthSeconds) && job.lengthSeconds >= 0.0;
+            else if (key == "samplerate")
+                ok = parse_number(value, job.sampleRate) && job.sampleRate > 0.0;
+            else if (key == "voices")
+                ok = parse_number(value, job.numVoices) && job.numVoices >= 1 &&
+                     job.numVoices <= max_poly_voices;
+            else if (key == "seed")
+                ok = parse_number(value, job.seed);
+            else if (key == "wav")
+                job.renderWav = value == "1";
+            else if (key == "midi2")
+                job.renderMidi2 = value == "1";
+            else if (auto rid = row_id_from_name(key))
+            {
+                job.rows[*rid] = parse_row(value);
+                ok = job.rows[*rid].has_value();
+            }
+            else if (key.starts_with("repeats.") && row_id_from_name(key.substr(8)))
+            {
+                size_t repeats = 0;
+                ok = parse_number(value, repeats) && repeats >= 1;
+                job.repeats[*row_id_from_name(key.substr(8))] = repeats;
+            }
+            else if (key.starts_with("transform.") && row_id_from_name(key.substr(10)))
+            {
+                auto &transforms = job.transforms[*row_id_from_name(key.substr(10))];
+                while (ok && !value.empty())
+                {
+                    auto slash = value.find('/');
+                    auto t = parse_transform(value.substr(0, slash));
+                    ok = t.has_value();
+                    if (ok)
+                        transforms.push_back(*t);
+                    value = slash == std::string_view::npos ? "" : value.substr(slash + 1);
+                }
+            }
+            else if (key.starts_with("playlist.") && row_id_from_name(key.substr(9)))
+            {
+                std::ifstream playlistfile(std::filesystem::u8path(value));
+                std::string playlisterror;
+                auto playlist = parse_playlist(playlistfile, playlisterror);
+                if (!playlistfile.is_open() || !playlist)
+                {
+                    error = std::format("line {} : can't read playlist {} {}", linenumber, value,
+                                        playlisterror);
+                    return {};
+                }
+                job.playlists[*row_id_from_name(key.substr(9))] = std::move(*playlist);
+            }
+            else if (key.starts_with("mutate.") && row_id_from_name(key.substr(7)))
+            {
+                auto mutation = parse_mutation(value);
+                ok = mutation.has_value();
+                if (ok)
+                    job.mutations[*row_id_from_name(key.substr(7))] = *mutation;
+            }
+            else
+                ok = false;
+            if (!ok)
+            {
+                error = std::format("line {} : invalid setting {}", linenumber, tok);
+                return {};
+            }
+        }
+        if (empty)
+            continue;
+        // the jobs are rendered in parallel, so two with the same name would write one file
+        for (const auto &other : jobs)
+        {
+            if (other.name == job.name)
+            {
+                error = std::format("line {} : duplicate name {}", linenumber, job.name);
+                return {};
+            }
+        }
+        jobs.push_back(std::move(job));
+    }
+    return jobs;
+}
+
+inline void setup_engine_for_job(SequencerEngine &engine, RowPlaylistFeeder &feeder,
+                                 const RenderJob &job)
+{
+    engine.prepare(job.sampleRate);
+    EngineParameters pars;
+    pars.numActiveVoices = job.numVoices;
+    for (size_t rid = 0; rid < RID_LAST; ++rid)
+    {
+        if (job.rows[rid])
+        {
+            MessageToProcessor msg;
+            msg.opcode = MessageToProcessor::OP_ChangeRow;
+            msg.row_index = rid;
+            msg.row = *job.rows[rid];
+            engine.handleMessage(msg);
+        }
+        if (job.repeats[rid])
+            pars.rowRepeats[rid] = *job.repeats[rid];
+        const auto &transforms = job.transforms[rid];
+        for (size_t v = 0; v < max_poly_voices && !transforms.empty(); ++v)
+            pars.transforms[rid][v] = transforms[std::min(v, transforms.size() - 1)];
+    }
+    pars.mutations = job.mutations;
+    engine.applyParameters(pars);
+    engine.setMutationSeed(job.seed);
+    for (size_t rid = 0; rid < RID_LAST; ++rid)
+        feeder.setPlaylist(engine, rid, job.playlists[rid]);
+}
+
+struct BatchRenderResult
+{
+    size_t numRendered = 0;
+    std::vector<std::string> failed;
+};
+
+// Renders the jobs on a pool of worker threads that pick the next unrendered job until all
+// are done. Every job gets its own engine instance, so the workers share nothing but the
+// job index.
+inline BatchRenderResult batch_render(const std::vector<RenderJob> &jobs,
+                                      std::filesystem::path outdir, unsigned int numThreads)
+{
+    std::atomic<size_t> nextJob{0};
+    std::vector<std::vector<std::string>> failures(numThreads);
+    auto worker = [&](unsigned int threadIndex) {
+        // constructed once per thread and reset for every job, rather than allocated per job
+        auto engine = std::make_unique<SequencerEngine>();
+        RowPlaylistFeeder feeder;
+        size_t index = 0;
+        while ((index = nextJob++) < jobs.size())
+        {
+            const auto &job = jobs[index];
+            engine->resetState();
+            setup_engine_for_job(*engine, feeder, job);
+            bool ok = render_to_midi(*engine, outdir / std::filesystem::u8path(job.name + ".mid"),
+                                     job.lengthSeconds, &feeder);
+            if (ok && job.renderMidi2)
+            {
+                engine->resetState();
+                setup_engine_for_job(*engine, feeder, job);
+                ok = render_to_midi2(*engine,
+                                     outdir / std::filesystem::u8path(job.name + ".midi2"),
+                                     job.lengthSeconds, &feeder);
+            }
+            if (ok && job.renderWav)
+            {
+                engine->resetState();
+                setup_engine_for_job(*engine, feeder, job);
+                ok = render_to_wav(*engine, outdir / std::filesystem::u8path(job.name + ".wav"),
+                                   job.lengthSeconds, &feeder);
+            }
+            if (!ok)
+                failures[threadIndex].push_back(job.name);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < numThreads; ++i)
+        threads.emplace_back(worker, i);
+    for (auto &t : threads)
+        t.join();
+    BatchRenderResult result;
+    for (auto &f : failures)
+        result.failed.insert(result.failed.end(), f.begin(), f.end());
+    result.numRendered = jobs.size() - result.failed.size();
+    return result;
+}
+
+} // namespace xenakios
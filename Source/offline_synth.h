@@ -0,0 +1,153 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include "sequencer_engine.h"
+
+namespace xenakios
+{
+
+// Minimal polyphonic synth for auditioning the sequencer output without a host. Voice state
+// is kept as structure of arrays and each voice is rendered in short sub-blocks where both the
+// oscillator phase and the envelope are closed form functions of the sample index, so the
+// inner loops have no loop carried dependencies and can be vectorized by the compiler.
+class OfflineSynth
+{
+  public:
+    static constexpr size_t maxVoices = 64;
+    static constexpr int subBlockSize = 64;
+
+    void prepare(double sr)
+    {
+        sampleRate = sr;
+        attackInc = 1.0f / float(0.005 * sr);
+        releaseInc = 1.0f / float(0.08 * sr);
+        numActive = 0;
+    }
+    void handleEvent(const SequencerEvent &ev)
+    {
+        if (ev.type == SequencerEvent::NoteOn)
+            noteOn(ev.chan, ev.note, ev.velocity);
+        else if (ev.type == SequencerEvent::NoteOff)
+            noteOff(ev.chan, ev.note);
+    }
+    void noteOn(int chan, int note, int velocity)
+    {
+        size_t v = numActive;
+        if (numActive == maxVoices)
+        {
+            // steal the quietest voice
+            v = std::min_element(envLevel.begin(), envLevel.end()) - envLevel.begin();
+        }
+        else
+            ++numActive;
+        double hz = 440.0 * std::pow(2.0, (note - 69) / 12.0);
+        phase[v] = 0.0f;
+        phaseInc[v] = float(hz / sampleRate);
+        float gain = velocity / 127.0f;
+        peak[v] = 0.2f * gain * gain;
+        envLevel[v] = 0.0f;
+        envInc[v] = attackInc;
+        keys[v] = chan * 128 + note;
+        // spread the sequencer voices across the stereo field
+        float pan = 0.2f + 0.6f * float((chan - 1) % 4) / 3.0f;
+        panLeft[v] = std::sqrt(1.0f - pan);
+        panRight[v] = std::sqrt(pan);
+    }
+    void noteOff(int chan, int note)
+    {
+        int key = chan * 128 + note;
+        for (size_t v = 0; v < numActive; ++v)
+        {
+            if (keys[v] == key && envInc[v] >= 0.0f)
+            {
+                envInc[v] = -releaseInc;
+                keys[v] = -1;
+                return;
+            }
+        }
+    }
+    // Renders numFrames samples replacing the contents of left and right
+    void render(float *left, float *right, int numFrames)
+    {
+        std::fill(left, left + numFrames, 0.0f);
+        std::fill(right, right + numFrames, 0.0f);
+        for (int start = 0; start < numFrames; start += subBlockSize)
+        {
+            int len = std::min(subBlockSize, numFrames - start);
+            for (size_t v = 0; v < numActive; ++v)
+                renderVoice(v, left + start, right + start, len);
+            removeFinishedVoices();
+        }
+    }
+    size_t getNumActiveVoices() const { return numActive; }
+
+  private:
+    void renderVoice(size_t v, float *left, float *right, int len)
+    {
+        // The envelope is linear over the sub-block, clamped to 0..1 at the segment ends
+        float e0 = envLevel[v];
+        float inc = envInc[v];
+        float p0 = phase[v];
+        float pinc = phaseInc[v];
+        float gl = peak[v] * panLeft[v];
+        float gr = peak[v] * panRight[v];
+        for (int i = 0; i < len; ++i)
+        {
+            float env = std::clamp(e0 + inc * i, 0.0f, 1.0f);
+            float p = p0 + pinc * i;
+            p -= float(int(p));
+            // parabolic sine approximation
+            float x = 2.0f * p - 1.0f;
+            float s = 4.0f * x * (1.0f - std::abs(x));
+            left[i] += gl * env * s;
+            right[i] += gr * env * s;
+        }
+        float p = p0 + pinc * len;
+        phase[v] = p - std::floor(p);
+        float e = e0 + inc * len;
+        if (inc > 0.0f && e >= 1.0f)
+        {
+            e = 1.0f;
+            envInc[v] = 0.0f;
+        }
+        envLevel[v] = std::clamp(e, 0.0f, 1.0f);
+    }
+    void removeFinishedVoices()
+    {
+        for (size_t v = 0; v < numActive;)
+        {
+            if (envInc[v] < 0.0f && envLevel[v] <= 0.0f)
+            {
+                --numActive;
+                phase[v] = phase[numActive];
+                phaseInc[v] = phaseInc[numActive];
+                peak[v] = peak[numActive];
+                envLevel[v] = envLevel[numActive];
+                envInc[v] = envInc[numActive];
+                panLeft[v] = panLeft[numActive];
+                panRight[v] = panRight[numActive];
+                keys[v] = keys[numActive];
+                envLevel[numActive] = 0.0f;
+            }
+            else
+                ++v;
+        }
+    }
+    double sampleRate = 44100.0;
+    float attackInc = 0.0f;
+    float releaseInc = 0.0f;
+    size_t numActive = 0;
+    std::array<float, maxVoices> phase{};
+    std::array<float, maxVoices> phaseInc{};
+    std::array<float, maxVoices> peak{};
+    std::array<float, maxVoices> envLevel{};
+    std::array<float, maxVoices> envInc{};
+    std::array<float, maxVoices> panLeft{};
+    std::array<float, maxVoices> panRight{};
+    std::array<int, maxVoices> keys{};
+};
+
+} // namespace xenakios
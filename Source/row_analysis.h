@@ -0,0 +1,200 @@
+#pragma once
+
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "row_engine.h"
+#include "sequencer_engine.h"
+
+namespace xenakios
+{
+
+struct RowAnalysisRequest
+{
+    Row row;
+    std::array<RowTransform, max_poly_voices> transforms;
+    bool operator==(const RowAnalysisRequest &other) const
+    {
+        return row.num_active_entries == other.row.num_active_entries &&
+               row.entries == other.row.entries && transforms == other.transforms;
+    }
+};
+
+// What the editor shows of a row besides its entries, derived from the row and the voices'
+// transforms
+struct RowAnalysis
+{
+    // what the analysis was computed from, so that a result for an older row isn't shown
+    RowAnalysisRequest request;
+    bool valid = false;
+    uint16_t length = 0;
+    // the row as each voice steps through it
+    std::array<std::array<uint8_t, Row::maxElements>, max_poly_voices> transformed{};
+    bool operator==(const RowAnalysis &) const = default;
+};
+
+inline RowAnalysis analyze_row(const RowAnalysisRequest &request)
+{
+    RowAnalysis result;
+    result.request = request;
+    Row row = request.row;
+    result.valid = row.isValid();
+    result.length = row.num_active_entries;
+    if (result.length == 0 || result.length > Row::maxElements)
+        return result;
+    for (size_t v = 0; v < max_poly_voices; ++v)
+    {
+        Row::Iterator it(row, request.transforms[v]);
+        for (uint16_t i = 0; i < result.length; ++i)
+        {
+            it.set_position(i);
+            it.repetition_counter = 0;
+            result.transformed[v][i] = it.next();
+        }
+    }
+    return result;
+}
+
+// Computes the row analyses of all the editors in the process on one background thread, so
+// that the message thread only picks up finished results. A client's pending job is replaced
+// by a newer one, and a result is only handed out when it differs from the previous one.
+// The thread runs while there are clients.
+class RowAnalysisQueue
+{
+    struct Slot
+    {
+        RowAnalysisRequest request;
+        RowAnalysis result;
+        bool pending = false;
+        bool hasNewResult = false;
+    };
+
+  public:
+    static RowAnalysisQueue &instance()
+    {
+        static RowAnalysisQueue queue;
+        return queue;
+    }
+    // One component's jobs, all methods are called from the message thread
+    class Client
+    {
+      public:
+        Client() : slot(std::make_shared<Slot>()) { RowAnalysisQueue::instance().addClient(); }
+        ~Client() { RowAnalysisQueue::instance().removeClient(); }
+        Client(const Client &) = delete;
+        Client &operator=(const Client &) = delete;
+        // Does nothing if the request is the same as the last one
+        void submit(const RowAnalysisRequest &request)
+        {
+            if (hasSubmitted && request == lastRequest)
+                return;
+            lastRequest = request;
+            hasSubmitted = true;
+            RowAnalysisQueue::instance().submit(slot, request);
+        }
+        // Returns true and the result if there's a new one different from the last
+        bool fetch(RowAnalysis &result)
+        {
+            return RowAnalysisQueue::instance().fetch(*slot, result);
+        }
+
+      private:
+        std::shared_ptr<Slot> slot;
+        RowAnalysisRequest lastRequest;
+        bool hasSubmitted = false;
+    };
+
+  private:
+    RowAnalysisQueue() = default;
+    ~RowAnalysisQueue()
+    {
+        if (worker.joinable())
+            stopThread();
+    }
+    void addClient()
+    {
+        std::lock_guard life(lifecycleMutex);
+        if (numClients++ > 0)
+            return;
+        {
+            std::lock_guard lock(mutex);
+            running = true;
+        }
+        worker = std::thread([this]() { run(); });
+    }
+    void removeClient()
+    {
+        std::lock_guard life(lifecycleMutex);
+        if (--numClients == 0)
+            stopThread();
+    }
+    void stopThread()
+    {
+        {
+            std::lock_guard lock(mutex);
+            running = false;
+            // the slots of the remaining jobs belong to clients that are gone
+            jobs.clear();
+        }
+        cv.notify_one();
+        worker.join();
+    }
+    void submit(const std::shared_ptr<Slot> &slot, const RowAnalysisRequest &request)
+    {
+        {
+            std::lock_guard lock(mutex);
+            slot->request = request;
+            if (slot->pending)
+                return;
+            slot->pending = true;
+            jobs.push_back(slot);
+        }
+        cv.notify_one();
+    }
+    bool fetch(Slot &slot, RowAnalysis &result)
+    {
+        std::lock_guard lock(mutex);
+        if (!slot.hasNewResult)
+            return false;
+        slot.hasNewResult = false;
+        result = slot.result;
+        return true;
+    }
+    void run()
+    {
+        std::unique_lock lock(mutex);
+        while (true)
+        {
+            cv.wait(lock, [this]() { return !running || !jobs.empty(); });
+            if (!running)
+                return;
+            auto slot = std::move(jobs.front());
+            jobs.pop_front();
+            slot->pending = false;
+            // the slot may be updated with a newer request while this one is analyzed
+            RowAnalysisRequest request = slot->request;
+            lock.unlock();
+            RowAnalysis analysis = analyze_row(request);
+            lock.lock();
+            if (analysis != slot->result)
+            {
+                slot->result = analysis;
+                slot->hasNewResult = true;
+            }
+        }
+    }
+    // serializes starting and stopping the thread
+    std::mutex lifecycleMutex;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<Slot>> jobs;
+    std::thread worker;
+    int numClients = 0;
+    bool running = false;
+};
+
+} // namespace xenakios
@@ -0,0 +1,469 @@
+// Finds the tone rows used in a collection of Standard MIDI Files, like serial repertoire or
+// renders from the plugin, and writes them grouped by transform class as a row playlist that
+// the plugin can load.
+//
+//   RowCorpus [--modulus 12] [--merged] [--threads N] [--out rows.txt] <files or folders>...
+//
+// A row is found where consecutive note ons contain each pitch class once. The files are memory
+// mapped and parsed in place on all cores, only the found rows are copied.
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <print>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "row_engine.h"
+#include "row_playlist.h"
+#include "midi_file.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace xenakios;
+
+// Read only memory mapping of a whole file
+class MappedFile
+{
+  public:
+    explicit MappedFile(const std::filesystem::path &path)
+    {
+#ifdef _WIN32
+        HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                  OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return;
+        LARGE_INTEGER filesize;
+        if (GetFileSizeEx(file, &filesize) && filesize.QuadPart > 0)
+        {
+            mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping)
+            {
+                data = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                if (data)
+                    size = (size_t)filesize.QuadPart;
+            }
+        }
+        CloseHandle(file);
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                madvise(p, st.st_size, MADV_SEQUENTIAL);
+                data = (const uint8_t *)p;
+                size = st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+    ~MappedFile()
+    {
+#ifdef _WIN32
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping)
+            CloseHandle(mapping);
+#else
+        if (data)
+            munmap((void *)data, size);
+#endif
+    }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    std::span<const uint8_t> bytes() const { return {data, size}; }
+
+  private:
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE mapping = nullptr;
+#endif
+};
+
+using RowKey = std::array<uint8_t, Row::maxElements>;
+
+inline RowKey row_key(const Row &row)
+{
+    RowKey key{};
+    for (size_t i = 0; i < row.num_active_entries; ++i)
+        key[i] = row.entries[i];
+    return key;
+}
+
+// The rows related by transposition, inversion and retrograde form a class, represented by the
+// lexicographically smallest of them
+inline Row class_representative(const Row &row)
+{
+    Row best = row;
+    RowKey bestkey = row_key(row);
+    for (int i = 0; i < 4 * (int)row.num_active_entries; ++i)
+    {
+        RowTransform t{uint16_t(i / 4), (i & 1) != 0, (i & 2) != 0};
+        Row candidate = row.transformed(t);
+        RowKey key = row_key(candidate);
+        if (key < bestkey)
+        {
+            best = candidate;
+            bestkey = key;
+        }
+    }
+    return best;
+}
+
+// The transform of the representative that gives the row
+inline RowTransform transform_between(const Row &representative, const Row &row)
+{
+    const RowKey target = row_key(row);
+    for (uint16_t tp = 0; tp < representative.num_active_entries; ++tp)
+        for (int kind = 0; kind < 4; ++kind)
+        {
+            RowTransform t{tp, (kind & 2) != 0, (kind & 1) != 0};
+            if (row_key(representative.transformed(t)) == target)
+                return t;
+        }
+    return {};
+}
+
+struct RowClass
+{
+    Row representative;
+    uint64_t count = 0;
+    uint64_t numFiles = 0;
+    // occurrences per transform, indexed by transform_to_index
+    std::array<uint64_t, max_transform_index + 1> formCounts{};
+    std::string firstFile;
+    // the number of the last file of the worker the class was found in
+    uint64_t lastFile = 0;
+};
+
+struct RowKeyHash
+{
+    size_t operator()(const RowKey &key) const
+    {
+        std::string_view bytes((const char *)key.data(), key.size());
+        return std::hash<std::string_view>{}(bytes);
+    }
+};
+
+struct CorpusOptions
+{
+    int modulus = 12;
+    // treat all the tracks of a file as one stream of notes, for rows split between voices
+    bool merged = false;
+    unsigned int numThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::filesystem::path outPath = "rows.txt";
+    std::vector<std::filesystem::path> inputs;
+};
+
+// The results of one worker thread, merged after all the files are done
+struct CorpusScan
+{
+    std::map<RowKey, RowClass> classes;
+    // The class and transform of the rows found so far. A corpus uses few distinct rows many
+    // times, so this saves trying all the transforms of each found row.
+    struct KnownRow
+    {
+        RowClass *cls = nullptr;
+        int formIndex = 0;
+    };
+    std::unordered_map<RowKey, KnownRow, RowKeyHash> knownRows;
+    uint64_t numFiles = 0;
+    uint64_t numInvalidFiles = 0;
+    uint64_t numBytes = 0;
+    uint64_t numNotes = 0;
+    uint64_t numRows = 0;
+};
+
+// Scans a stream of pitches for windows that contain every pitch class once. The windows don't
+// overlap, so a repeated row isn't also reported as its rotations.
+class AggregateFinder
+{
+  public:
+    explicit AggregateFinder(int m) : modulus(m) { reset(); }
+    void reset()
+    {
+        counts.fill(0);
+        numDistinct = 0;
+        numInWindow = 0;
+    }
+    template <typename Callback> void add(int note, Callback &&onRow)
+    {
+        const int pc = note % modulus;
+        // the window is a ring of the last modulus pitch classes, ending at numInWindow - 1
+        if (numInWindow >= modulus)
+        {
+            int oldest = window[numInWindow % modulus];
+            if (--counts[oldest] == 0)
+                --numDistinct;
+        }
+        window[numInWindow % modulus] = pc;
+        ++numInWindow;
+        if (counts[pc]++ == 0)
+            ++numDistinct;
+        if (numDistinct == modulus)
+        {
+            Row row;
+            row.num_active_entries = modulus;
+            for (int i = 0; i < modulus; ++i)
+                row.entries[i] = window[(numInWindow + i) % modulus];
+            if (row.isValid())
+                onRow(row);
+            reset();
+        }
+    }
+
+  private:
+    int modulus = 12;
+    std::array<int, Row::maxElements> counts;
+    std::array<int, Row::maxElements> window;
+    int numDistinct = 0;
+    int numInWindow = 0;
+};
+
+inline void scan_file(const std::filesystem::path &path, const CorpusOptions &opts,
+                      MidiFileReader &reader, CorpusScan &scan)
+{
+    MappedFile file(path);
+    auto bytes = file.bytes();
+    ++scan.numFiles;
+    scan.numBytes += bytes.size();
+    if (!reader.parse(bytes))
+    {
+        ++scan.numInvalidFiles;
+        return;
+    }
+    auto onRow = [&](const Row &row) {
+        auto [known, isnew] = scan.knownRows.try_emplace(row_key(row));
+        if (isnew)
+        {
+            Row rep = class_representative(row);
+            auto [it, inserted] = scan.classes.try_emplace(row_key(rep));
+            if (inserted)
+            {
+                it->second.representative = rep;
+                it->second.firstFile = path.string();
+            }
+            known->second = {&it->second, transform_to_index(transform_between(rep, row))};
+        }
+        auto &cls = *known->second.cls;
+        ++cls.count;
+        ++cls.formCounts[known->second.formIndex];
+        if (cls.lastFile != scan.numFiles)
+        {
+            cls.lastFile = scan.numFiles;
+            ++cls.numFiles;
+        }
+        ++scan.numRows;
+    };
+    AggregateFinder finder(opts.modulus);
+    if (opts.merged)
+    {
+        struct Note
+        {
+            uint64_t tick;
+            int note;
+        };
+        std::vector<Note> notes;
+        for (auto track : reader.tracks)
+            MidiFileReader::forEachNoteOn(track, [&](uint64_t tick, int, int note, int) {
+                notes.push_back({tick, note});
+            });
+        // chords are read from the lowest note up
+        std::stable_sort(notes.begin(), notes.end(), [](const Note &a, const Note &b) {
+            return a.tick < b.tick || (a.tick == b.tick && a.note < b.note);
+        });
+        scan.numNotes += notes.size();
+        for (auto &n : notes)
+            finder.add(n.note, onRow);
+    }
+    else
+    {
+        for (auto track : reader.tracks)
+        {
+            finder.reset();
+            MidiFileReader::forEachNoteOn(track, [&](uint64_t, int, int note, int) {
+                ++scan.numNotes;
+                finder.add(note, onRow);
+            });
+        }
+    }
+}
+
+inline std::vector<std::filesystem::path> find_midi_files(
+    const std::vector<std::filesystem::path> &inputs)
+{
+    std::vector<std::filesystem::path> result;
+    auto ismidi = [](const std::filesystem::path &p) {
+        auto ext = p.extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        return ext == ".mid" || ext == ".midi" || ext == ".smf";
+    };
+    for (const auto &input : inputs)
+    {
+        std::error_code ec;
+        if (std::filesystem::is_directory(input, ec))
+        {
+            for (auto it = std::filesystem::recursive_directory_iterator(input, ec);
+                 it != std::filesystem::recursive_directory_iterator(); it.increment(ec))
+            {
+                if (ec)
+                    break;
+                if (it->is_regular_file(ec) && ismidi(it->path()))
+                    result.push_back(it->path());
+            }
+        }
+        else if (std::filesystem::is_regular_file(input, ec))
+            result.push_back(input);
+    }
+    return result;
+}
+
+inline std::string transform_name(const RowTransform &t)
+{
+    const char *kind = t.inverted ? (t.reversed ? "RI" : "I") : (t.reversed ? "R" : "P");
+    return std::format("{}{}", kind, t.transpose);
+}
+
+// Writes the classes as a playlist of their representatives, most common first, with the
+// statistics in comments
+inline bool write_row_bank(const std::filesystem::path &path, std::vector<RowClass> &classes,
+                           const CorpusScan &totals)
+{
+    std::ofstream os(path);
+    if (!os.is_open())
+        return false;
+    std::sort(classes.begin(), classes.end(),
+              [](const RowClass &a, const RowClass &b) { return a.count > b.count; });
+    os << std::format("# {} rows in {} transform classes, found in {} MIDI files\n",
+                      totals.numRows, classes.size(), totals.numFiles);
+    for (const auto &cls : classes)
+    {
+        std::string rowtxt;
+        for (size_t i = 0; i < cls.representative.num_active_entries; ++i)
+            rowtxt += std::format("{}{}", i > 0 ? "," : "", cls.representative.entries[i]);
+        std::vector<std::pair<uint64_t, int>> forms;
+        for (int i = 0; i <= max_transform_index; ++i)
+            if (cls.formCounts[i] > 0)
+                forms.push_back({cls.formCounts[i], i});
+        std::sort(forms.begin(), forms.end(), std::greater<>());
+        std::string formtxt;
+        for (size_t i = 0; i < std::min<size_t>(forms.size(), 8); ++i)
+            formtxt += std::format(" {}x{}", transform_name(transform_from_index(forms[i].second)),
+                                   forms[i].first);
+        os << std::format("# {} rows in {} files, first in {}, forms{}\n", cls.count,
+                          cls.numFiles, cls.firstFile, formtxt);
+        os << std::format("{} P0\n", rowtxt);
+    }
+    return os.good();
+}
+
+inline int run_corpus(const CorpusOptions &opts)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    auto files = find_midi_files(opts.inputs);
+    if (files.empty())
+    {
+        std::print("no MIDI files found\n");
+        return 1;
+    }
+    std::atomic<size_t> nextFile{0};
+    std::vector<CorpusScan> scans(opts.numThreads);
+    auto worker = [&](unsigned int threadIndex) {
+        MidiFileReader reader;
+        size_t index = 0;
+        while ((index = nextFile++) < files.size())
+            scan_file(files[index], opts, reader, scans[threadIndex]);
+    };
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < opts.numThreads; ++i)
+        threads.emplace_back(worker, i);
+    for (auto &t : threads)
+        t.join();
+
+    CorpusScan totals;
+    for (auto &scan : scans)
+    {
+        totals.numFiles += scan.numFiles;
+        totals.numInvalidFiles += scan.numInvalidFiles;
+        totals.numBytes += scan.numBytes;
+        totals.numNotes += scan.numNotes;
+        totals.numRows += scan.numRows;
+        for (auto &[key, cls] : scan.classes)
+        {
+            auto [it, inserted] = totals.classes.try_emplace(key, cls);
+            if (inserted)
+                continue;
+            auto &dest = it->second;
+            dest.count += cls.count;
+            dest.numFiles += cls.numFiles;
+            for (size_t i = 0; i < dest.formCounts.size(); ++i)
+                dest.formCounts[i] += cls.formCounts[i];
+            dest.firstFile = std::min(dest.firstFile, cls.firstFile);
+        }
+    }
+    std::vector<RowClass> classes;
+    classes.reserve(totals.classes.size());
+    for (auto &[key, cls] : totals.classes)
+        classes.push_back(cls);
+    if (!write_row_bank(opts.outPath, classes, totals))
+    {
+        std::print("could not write {}\n", opts.outPath.string());
+        return 1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::print("{} files ({} unreadable), {:.1f} MB, {} notes in {:.2f} s, {:.1f} MB/s\n",
+               totals.numFiles, totals.numInvalidFiles, totals.numBytes / 1e6, totals.numNotes,
+               seconds, totals.numBytes / 1e6 / seconds);
+    std::print("{} rows in {} transform classes written to {}\n", totals.numRows, classes.size(),
+               opts.outPath.string());
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    CorpusOptions opts;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view arg{argv[i]};
+        if (arg == "--modulus" && i + 1 < argc)
+            opts.modulus = std::clamp(std::stoi(argv[++i]), 2, (int)Row::maxElements);
+        else if (arg == "--threads" && i + 1 < argc)
+            opts.numThreads = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--out" && i + 1 < argc)
+            opts.outPath = std::filesystem::u8path(argv[++i]);
+        else if (arg == "--merged")
+            opts.merged = true;
+        else
+            opts.inputs.push_back(std::filesystem::u8path(arg));
+    }
+    if (opts.inputs.empty())
+    {
+        std::print("usage : RowCorpus [--modulus 12] [--merged] [--threads N] [--out rows.txt] "
+                   "<files or folders>...\n");
+        return 1;
+    }
+    return run_corpus(opts);
+}
@@ -1,9 +1,11 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <cstdint>
 #include <initializer_list>
+#include <numeric>
 #include <string>
 #include <format>
 
@@ -25,7 +27,8 @@ struct RowTransform
     uint16_t transpose = 0;
     bool inverted = false;
     bool reversed = false;
-    std::string to_string()
+    bool operator==(const RowTransform &) const = default;
+    std::string to_string() const
     {
         if (!inverted && !reversed)
             return std::format("Prime {}", transpose);
@@ -39,6 +42,45 @@ struct RowTransform
     }
 };
 
+// xoshiro256** by Blackman and Vigna, seeded with splitmix64. Small, fast and the state can be
+// copied and stored, so sequences generated with it can be reproduced.
+class Xoshiro256
+{
+  public:
+    Xoshiro256(uint64_t seed = 1) { setSeed(seed); }
+    void setSeed(uint64_t seed)
+    {
+        for (auto &st : state)
+        {
+            seed += 0x9e3779b97f4a7c15ULL;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            st = z ^ (z >> 31);
+        }
+    }
+    uint64_t next()
+    {
+        const uint64_t result = rotl(state[1] * 5, 7) * 9;
+        const uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
+    }
+    // uniformly distributed in 0..1
+    float nextFloat() { return (next() >> 40) * 0x1.0p-24f; }
+    // in the range 0..n-1, using the multiply and shift method instead of a division
+    uint32_t nextBelow(uint32_t n) { return uint32_t(((next() >> 32) * uint64_t(n)) >> 32); }
+    std::array<uint64_t, 4> state;
+
+  private:
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+};
+
 class Row
 {
   public:
@@ -82,6 +124,27 @@ class Row
     std::array<uint16_t, maxElements> entries;
     uint16_t num_active_entries = 0;
 
+    // Rotates the row left by the given amount of steps
+    void rotate(size_t steps)
+    {
+        if (num_active_entries == 0)
+            return;
+        std::rotate(entries.begin(), entries.begin() + steps % num_active_entries,
+                    entries.begin() + num_active_entries);
+    }
+    void swap_entries(size_t a, size_t b) { std::swap(entries[a], entries[b]); }
+    // Multiplies the elements by factor modulo the row length, like the M5 and M7 operations
+    // of 12 tone rows. Only done if the factor is coprime with the row length, so that a valid
+    // row stays valid.
+    bool multiply(uint16_t factor)
+    {
+        if (num_active_entries == 0 || std::gcd(factor, num_active_entries) != 1)
+            return false;
+        for (size_t i = 0; i < num_active_entries; ++i)
+            entries[i] = (entries[i] * factor) % num_active_entries;
+        return true;
+    }
+
     bool isValid() const
     {
         if (num_active_entries == 0)
@@ -97,6 +160,21 @@ class Row
         }
         return true;
     }
+    // The row with the transform applied to its elements, as Iterator would produce them
+    Row transformed(RowTransform t) const
+    {
+        Row result;
+        result.num_active_entries = num_active_entries;
+        const uint16_t len = num_active_entries;
+        for (uint16_t i = 0; i < len; ++i)
+        {
+            uint16_t v = (entries[t.reversed ? len - 1 - i : i] + t.transpose) % len;
+            if (t.inverted)
+                v = (len - v) % len;
+            result.entries[i] = v;
+        }
+        return result;
+    }
     class Iterator
     {
       public:
@@ -105,6 +183,8 @@ class Row
         int repetitions = 1;
         int repetition_counter = 0;
         int pos = 0;
+        // set when the position wraps around to the start of the row
+        bool wrapped = false;
         Iterator() = default;
         Iterator(Row &r, RowTransform t) : row(&r), transform(t) {}
         void set_position(uint16_t p) { pos = p; }
@@ -125,7 +205,10 @@ class Row
                 repetition_counter = 0;
                 ++pos;
                 if (pos == row->num_active_entries)
+                {
                     pos = 0;
+                    wrapped = true;
+                }
             }
             ++repetition_counter;
             return result;
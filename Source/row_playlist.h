@@ -0,0 +1,208 @@
+#pragma once
+
+#include <charconv>
+#include <istream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "row_engine.h"
+#include "sequencer_engine.h"
+
+namespace xenakios
+{
+
+struct RowPlaylistEntry
+{
+    Row row;
+    RowTransform transform;
+};
+
+struct RowPlaylist
+{
+    std::vector<RowPlaylistEntry> entries;
+    // when false the last row stays in use after the playlist has been played through
+    bool loop = true;
+};
+
+// Keeps the engine's playlist queues topped up with prepared rows. The playlists can be any
+// length, the audio thread only ever sees the few rows prepared ahead. setPlaylist and refill
+// must be called from the same thread, which must not be the audio thread.
+class RowPlaylistFeeder
+{
+  public:
+    // Replaces the playlist of a row dimension. Rows still queued from the previous playlist
+    // are skipped by the engine. An empty playlist stops the playlist playback of the row.
+    bool setPlaylist(SequencerEngine &eng, size_t rid, RowPlaylist playlist)
+    {
+        if (rid >= RID_LAST)
+            return false;
+        for (auto &e : playlist.entries)
+        {
+            // the velocities are mapped over the row length, which needs at least 2 entries
+            if (!e.row.isValid() || (rid == RID_VELOCITY && e.row.num_active_entries < 2))
+                return false;
+        }
+        auto &state = states[rid];
+        state.playlist = std::move(playlist);
+        state.nextIndex = 0;
+        state.hasPending = false;
+        // generations aren't reused, so no stale row can match the new playlist
+        eng.playlistGenerations[rid] = state.playlist.entries.empty() ? 0 : nextGeneration++;
+        refill(eng);
+        return true;
+    }
+    void clearPlaylist(SequencerEngine &eng, size_t rid) { setPlaylist(eng, rid, {}); }
+    const RowPlaylist &getPlaylist(size_t rid) const { return states[rid].playlist; }
+    // Prepares rows until the queues are full or the playlists have no more rows
+    void refill(SequencerEngine &eng)
+    {
+        for (size_t rid = 0; rid < RID_LAST; ++rid)
+        {
+            auto &state = states[rid];
+            const auto &entries = state.playlist.entries;
+            const uint32_t generation = eng.playlistGenerations[rid];
+            while (!entries.empty())
+            {
+                if (!state.hasPending)
+                {
+                    if (state.nextIndex == entries.size())
+                    {
+                        if (!state.playlist.loop)
+                            break;
+                        state.nextIndex = 0;
+                    }
+                    const auto &e = entries[state.nextIndex];
+                    const bool last =
+                        !state.playlist.loop && state.nextIndex + 1 == entries.size();
+                    state.pending = {e.row.transformed(e.transform), uint32_t(state.nextIndex),
+                                     generation, last};
+                    state.hasPending = true;
+                    ++state.nextIndex;
+                }
+                if (!eng.playlistQueues[rid].push(state.pending))
+                    break;
+                state.hasPending = false;
+            }
+        }
+    }
+
+  private:
+    struct State
+    {
+        RowPlaylist playlist;
+        size_t nextIndex = 0;
+        // prepared but didn't fit in the queue yet
+        PlaylistRow pending;
+        bool hasPending = false;
+    };
+    std::array<State, RID_LAST> states;
+    uint32_t nextGeneration = 1;
+};
+
+template <typename T> inline bool parse_number(std::string_view txt, T &result)
+{
+    auto res = std::from_chars(txt.data(), txt.data() + txt.size(), result);
+    return res.ec == std::errc() && res.ptr == txt.data() + txt.size();
+}
+
+inline std::optional<Row> parse_row(std::string_view txt)
+{
+    Row row;
+    row.num_active_entries = 0;
+    while (!txt.empty())
+    {
+        auto comma = txt.find(',');
+        auto tok = txt.substr(0, comma);
+        unsigned int v = 0;
+        auto res = std::from_chars(tok.data(), tok.data() + tok.size(), v);
+        if (res.ec != std::errc() || v >= Row::maxElements ||
+            row.num_active_entries == Row::maxElements)
+            return {};
+        row.entries[row.num_active_entries++] = v;
+        if (comma == std::string_view::npos)
+            break;
+        txt.remove_prefix(comma + 1);
+    }
+    if (row.num_active_entries == 0)
+        return {};
+    return row;
+}
+
+// Transforms are written as P, R, I or RI followed by the transposition, eg. RI3
+inline std::optional<RowTransform> parse_transform(std::string_view txt)
+{
+    RowTransform t;
+    if (txt.starts_with("RI"))
+    {
+        t.reversed = t.inverted = true;
+        txt.remove_prefix(2);
+    }
+    else if (txt.starts_with("R"))
+    {
+        t.reversed = true;
+        txt.remove_prefix(1);
+    }
+    else if (txt.starts_with("I"))
+    {
+        t.inverted = true;
+        txt.remove_prefix(1);
+    }
+    else if (txt.starts_with("P"))
+        txt.remove_prefix(1);
+    else
+        return {};
+    if (!txt.empty())
+    {
+        auto res = std::from_chars(txt.data(), txt.data() + txt.size(), t.transpose);
+        if (res.ec != std::errc())
+            return {};
+    }
+    return t;
+}
+
+// A playlist file has one row per line, optionally followed by a transform, eg.
+//   0,11,1,10,2,9,3,8,4,7,5,6 RI3
+// Lines starting with # are comments and a line with just "once" disables looping.
+inline std::optional<RowPlaylist> parse_playlist(std::istream &is, std::string &error)
+{
+    RowPlaylist playlist;
+    std::string line;
+    int linenumber = 0;
+    while (std::getline(is, line))
+    {
+        ++linenumber;
+        std::istringstream tokens(line);
+        std::string rowtxt, transformtxt;
+        if (!(tokens >> rowtxt) || rowtxt.starts_with("#"))
+            continue;
+        if (rowtxt == "once")
+        {
+            playlist.loop = false;
+            continue;
+        }
+        RowPlaylistEntry entry;
+        auto row = parse_row(rowtxt);
+        if (!row || !row->isValid())
+        {
+            error = std::format("line {} : invalid row {}", linenumber, rowtxt);
+            return {};
+        }
+        entry.row = *row;
+        if (tokens >> transformtxt && !transformtxt.starts_with("#"))
+        {
+            auto t = parse_transform(transformtxt);
+            if (!t)
+            {
+                error = std::format("line {} : invalid transform {}", linenumber, transformtxt);
+                return {};
+            }
+            entry.transform = *t;
+        }
+        playlist.entries.push_back(entry);
+    }
+    return playlist;
+}
+
+} // namespace xenakios
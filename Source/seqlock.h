@@ -0,0 +1,65 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace xenakios
+{
+
+// Seqlock protected value for sharing small trivially copyable structs between threads.
+// Readers never block the writer and retry if the value changed while they copied it. The
+// value is stored as relaxed atomic words, so the concurrent copies aren't data races. Writers
+// from different threads serialize on the sequence number, which is only held for the copy.
+template <typename T> class SeqlockValue
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+    static constexpr size_t numWords = (sizeof(T) + 7) / 8;
+
+  public:
+    void write(const T &value)
+    {
+        uint64_t buf[numWords] = {};
+        std::memcpy(buf, &value, sizeof(T));
+        uint32_t seq = sequence.load(std::memory_order_relaxed);
+        while ((seq & 1) != 0 ||
+               !sequence.compare_exchange_weak(seq, seq + 1, std::memory_order_relaxed))
+            seq = sequence.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < numWords; ++i)
+            words[i].store(buf[i], std::memory_order_relaxed);
+        sequence.store(seq + 2, std::memory_order_release);
+    }
+    // Returns false if nothing has been written yet or the value kept changing during the reads
+    bool read(T &result) const
+    {
+        for (int attempt = 0; attempt < 64; ++attempt)
+        {
+            uint32_t seq = sequence.load(std::memory_order_acquire);
+            if (seq == 0)
+                return false;
+            if ((seq & 1) != 0)
+                continue;
+            uint64_t buf[numWords];
+            for (size_t i = 0; i < numWords; ++i)
+                buf[i] = words[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence.load(std::memory_order_relaxed) == seq)
+            {
+                std::memcpy(&result, buf, sizeof(T));
+                return true;
+            }
+        }
+        return false;
+    }
+    // Incremented by every write, 0 until the first write
+    uint32_t version() const { return sequence.load(std::memory_order_acquire) / 2; }
+
+  private:
+    std::atomic<uint32_t> sequence{0};
+    std::array<std::atomic<uint64_t>, numWords> words{};
+};
+
+} // namespace xenakios
@@ -0,0 +1,962 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+#include "row_engine.h"
+#include "seqlock.h"
+#include "trace.h"
+#include "containers/choc_SingleReaderSingleWriterFIFO.h"
+
+namespace xenakios
+{
+
+constexpr size_t max_poly_voices = 4;
+
+struct Voice
+{
+    std::array<Row::Iterator, RID_LAST> rowIterators;
+    int playpos = 0;
+    int pulselen = 11025;
+    int notelen = 11025;
+    int outchan = 0;
+};
+
+struct MessageToUI
+{
+    enum Op
+    {
+        OP_None,
+        OP_VoiceCountChanged,
+        OP_RowChanged,
+        // a mutation changed the transform of voice par1 on row par0
+        OP_TransformChanged
+    };
+    Op opcode = OP_None;
+    RowTransform transform;
+    int par0 = 0;
+    int par1 = 0;
+    Row row;
+};
+
+// What the voices last played, published by the engine once per block for the editor to read
+// whenever it repaints
+struct PlaybackState
+{
+    // the row positions of the last triggered step, -1 before the first trigger
+    std::array<std::array<int16_t, RID_LAST>, max_poly_voices> playpositions;
+    std::array<int16_t, max_poly_voices> soundingPitches;
+    // incremented by every trigger, so that readers can tell repeated steps apart
+    std::array<uint32_t, max_poly_voices> triggerCounts{};
+    PlaybackState()
+    {
+        for (auto &p : playpositions)
+            p.fill(-1);
+        soundingPitches.fill(-1);
+    }
+};
+
+// What a row dimension added at runtime controls
+enum class DimensionTarget : uint8_t
+{
+    ControlChange,
+    // in sixteenth notes, like the onset differences
+    NoteLength,
+    MidiChannel
+};
+
+// A row driven dimension added at runtime next to the built in ones. The row values
+// 0..length-1 are mapped linearly to low..high.
+struct RowDimension
+{
+    DimensionTarget target = DimensionTarget::ControlChange;
+    uint8_t controller = 1;
+    int16_t low = 0;
+    int16_t high = 127;
+    uint16_t repeats = 1;
+    bool operator==(const RowDimension &) const = default;
+};
+
+constexpr size_t max_row_dimensions = 32;
+
+// The longest combined period of the built in rows that the engine caches, in triggers
+constexpr size_t max_cycle_cache_steps = 2048;
+
+// Row content changes from the editor. Everything else reaches the engine as parameters.
+// For the runtime dimensions, row_index is the dimension index.
+struct MessageToProcessor
+{
+    enum Op
+    {
+        OP_None,
+        OP_ChangeRow,
+        OP_SetDimension,
+        OP_RemoveDimension
+    };
+    Op opcode = OP_None;
+    uint16_t row_index = 0;
+    Row row;
+    RowDimension dimension;
+};
+
+using toproc_fifo_t = choc::fifo::SingleReaderSingleWriterFIFO<MessageToProcessor>;
+
+// A playlist row prepared off the audio thread, with its transform already applied. The
+// generation identifies the playlist it came from, so rows left over from a replaced playlist
+// can be skipped.
+struct PlaylistRow
+{
+    Row row;
+    uint32_t index = 0;
+    uint32_t generation = 0;
+    // the final row of a playlist that doesn't loop
+    bool last = false;
+};
+
+// The timing of all voices after one block, shared by the engines locked to the same clock
+struct PulseBlock
+{
+    std::array<uint8_t, max_poly_voices> triggers{};
+    // the sample offsets of the triggers within the block
+    std::array<int, max_poly_voices> offsets{};
+    std::array<int, max_poly_voices> playpos{};
+    std::array<int, max_poly_voices> pulselen{};
+};
+
+// How many playlist rows are prepared ahead for each row dimension
+constexpr size_t playlist_prefetch_depth = 8;
+
+using playlist_fifo_t = choc::fifo::SingleReaderSingleWriterFIFO<PlaylistRow>;
+
+struct TransportInfo
+{
+    double bpm = 120.0;
+    double ppqpos = 0.0;
+    bool isPlaying = false;
+};
+
+// Plain MIDI event as produced by the engine, independent of any plugin framework
+struct SequencerEvent
+{
+    enum Type : uint8_t
+    {
+        NoteOff,
+        NoteOn,
+        // note is the controller number and velocity the value
+        ControlChange
+    };
+    uint32_t offset = 0;
+    Type type = NoteOff;
+    uint8_t chan = 1;
+    uint8_t note = 0;
+    uint8_t velocity = 0;
+    // The note on values in MIDI 2.0 resolution. The velocity spans 0..65535 and its upper 7
+    // bits are the MIDI 1.0 velocity. The pitch is 7.9 fixed point semitones, the pressure
+    // comes from the poly aftertouch row.
+    uint16_t velocity16 = 0;
+    uint16_t pitch = 0;
+    uint32_t pressure = 0;
+};
+
+// The MIDI status byte of the event, including the channel
+inline uint8_t midi_status(const SequencerEvent &ev)
+{
+    uint8_t status = 0x80;
+    if (ev.type == SequencerEvent::NoteOn)
+        status = 0x90;
+    else if (ev.type == SequencerEvent::ControlChange)
+        status = 0xb0;
+    return status | ((ev.chan - 1) & 0x0f);
+}
+
+// Transforms are exposed to the host as integers 0..127, the kind (P, R, I, RI) times 32 plus
+// the transposition
+constexpr int max_transform_index = 4 * Row::maxElements - 1;
+
+inline int transform_to_index(const RowTransform &t)
+{
+    int kind = (t.reversed ? 1 : 0) + (t.inverted ? 2 : 0);
+    return kind * Row::maxElements + t.transpose % Row::maxElements;
+}
+
+inline RowTransform transform_from_index(int index)
+{
+    index = std::clamp(index, 0, max_transform_index);
+    int kind = index / Row::maxElements;
+    return {uint16_t(index % Row::maxElements), (kind & 2) != 0, (kind & 1) != 0};
+}
+
+// The octave row is stepped through more slowly than the others by default
+constexpr std::array<size_t, RID_LAST> default_row_repeats()
+{
+    std::array<size_t, RID_LAST> result{};
+    result.fill(1);
+    result[RID_OCTAVE] = 6;
+    return result;
+}
+
+// Probabilities of generative changes happening each time a row completes a cycle
+struct RowMutationSettings
+{
+    // random transposition, inversion and retrograde, chosen per voice
+    float newTransform = 0.0f;
+    // the following change the row itself, which is shared by all voices
+    float rotate = 0.0f;
+    float swapPair = 0.0f;
+    // M5 or M7 multiplication
+    float multiply = 0.0f;
+    bool isActive() const
+    {
+        return newTransform > 0.0f || rotate > 0.0f || swapPair > 0.0f || multiply > 0.0f;
+    }
+    bool operator==(const RowMutationSettings &) const = default;
+};
+
+// The host automatable state of the engine, read from the plugin parameters once per block.
+// The automation is deliberately not sample accurate : the block isn't split at the changes,
+// as the shared clock timing and the session log records are per block. A change made within
+// a block applies from the first trigger of the block.
+struct EngineParameters
+{
+    std::array<std::array<RowTransform, max_poly_voices>, RID_LAST> transforms{};
+    std::array<size_t, RID_LAST> rowRepeats = default_row_repeats();
+    size_t numActiveVoices = 2;
+    int velocityLow = 64;
+    bool selfSequence = true;
+    std::array<RowMutationSettings, RID_LAST> mutations{};
+    bool operator==(const EngineParameters &) const = default;
+};
+
+// The row sequencing state and logic, without any JUCE dependencies so that it can also be
+// driven from the headless testing program. The row iterators point into the rows array,
+// so the engine can't be copied or moved.
+class SequencerEngine
+{
+  public:
+    SequencerEngine()
+    {
+        fifo_to_ui.reset(1024);
+        playingNotes.reserve(1024);
+        outputEvents.reserve(1024);
+        playlistSwitches.reserve(64);
+        for (auto &q : playlistQueues)
+            q.reset(playlist_prefetch_depth);
+        for (auto &c : cycleCaches)
+            c.steps.reserve(max_cycle_cache_steps);
+        resetState();
+    }
+    // Returns the rows and voices to their defaults, without releasing any allocated memory
+    void resetState()
+    {
+        rows[RID_PITCHCLASS] = Row::make_all_interval(12);
+        rows[RID_DELTATIME] = Row::make_from_init_list({4, 3, 2, 0, 1});
+        rows[RID_OCTAVE] = Row::make_from_init_list({3, 2, 1, 0});
+        rows[RID_VELOCITY] = Row::make_from_init_list({2, 3, 0, 1});
+        rows[RID_POLYAT] = Row::make_from_init_list({2, 3, 0, 1, 5, 4});
+        for (size_t rid = 0; rid < RID_LAST; ++rid)
+            rowSnapshots[rid].write(rows[rid]);
+        lastParameters = EngineParameters();
+        rowRepeats = lastParameters.rowRepeats;
+        for (size_t i = 0; i < max_poly_voices; ++i)
+        {
+            voices[i] = Voice();
+            for (size_t j = 0; j < RID_LAST; ++j)
+            {
+                voices[i].rowIterators[j] = Row::Iterator(rows[j], RowTransform());
+                voices[i].rowIterators[j].repetitions = rowRepeats[j];
+            }
+        }
+        num_active_voices = lastParameters.numActiveVoices;
+        velocityLow = lastParameters.velocityLow;
+        selfSequence = lastParameters.selfSequence;
+        notelen = 11025;
+        mutationSettings = lastParameters.mutations;
+        mutationRng.setSeed(1);
+        PlaylistRow pr;
+        for (size_t rid = 0; rid < RID_LAST; ++rid)
+        {
+            while (playlistQueues[rid].pop(pr))
+                ;
+            playlistGenerations[rid] = 0;
+        }
+        blockGenerations.fill(0);
+        numDimensions = 0;
+        dimensionCursors.fill({});
+        playingNotes.clear();
+        outputEvents.clear();
+        playlistSwitches.clear();
+        currentPlayback = PlaybackState();
+        playbackState.write(currentPlayback);
+        invalidateCycleCaches();
+    }
+    SequencerEngine(const SequencerEngine &) = delete;
+    SequencerEngine &operator=(const SequencerEngine &) = delete;
+
+    void prepare(double sr)
+    {
+        sampleRate = sr;
+        send_ui_updates = true;
+        // the cached pulse lengths are in samples
+        invalidateCycleCaches();
+    }
+    // Sets the tempo of the sixteenths the pulse and note lengths are counted in. A voice's
+    // current pulse keeps its length, the change applies from its next step.
+    void setTempo(double newBpm)
+    {
+        newBpm = std::clamp(newBpm, 10.0, 1000.0);
+        if (newBpm == bpm)
+            return;
+        bpm = newBpm;
+        invalidateCycleCaches();
+    }
+    void handleMessage(const MessageToProcessor &amsg)
+    {
+        if (amsg.opcode == MessageToProcessor::OP_ChangeRow)
+        {
+            if (amsg.row.num_active_entries == 0 ||
+                amsg.row.num_active_entries > Row::maxElements || amsg.row_index >= RID_LAST)
+                return;
+            setRow(amsg.row_index, amsg.row);
+        }
+        else if (amsg.opcode == MessageToProcessor::OP_SetDimension)
+            setDimension(amsg.row_index, amsg.dimension, amsg.row);
+        else if (amsg.opcode == MessageToProcessor::OP_RemoveDimension)
+            removeDimension(amsg.row_index);
+    }
+    // Adds a dimension when index is numDimensions, otherwise replaces the dimension at index,
+    // keeping the voices' positions in it
+    bool setDimension(size_t index, const RowDimension &dim, const Row &row)
+    {
+        if (index > numDimensions || index >= max_row_dimensions ||
+            row.num_active_entries == 0 || row.num_active_entries > Row::maxElements)
+            return false;
+        if (index == numDimensions)
+        {
+            ++numDimensions;
+            for (size_t v = 0; v < max_poly_voices; ++v)
+                dimensionCursors[v * max_row_dimensions + index] = {};
+        }
+        dimensions[index] = dim;
+        dimensions[index].repeats = std::max<uint16_t>(dim.repeats, 1);
+        dimensionRows[index] = row;
+        for (size_t v = 0; v < max_poly_voices; ++v)
+        {
+            auto &c = dimensionCursors[v * max_row_dimensions + index];
+            c.pos %= row.num_active_entries;
+            c.repetitionCounter = 0;
+        }
+        updateDimensionValues(index);
+        return true;
+    }
+    // Removes a dimension, the later ones move down by one index
+    void removeDimension(size_t index)
+    {
+        if (index >= numDimensions)
+            return;
+        for (size_t d = index; d + 1 < numDimensions; ++d)
+        {
+            dimensions[d] = dimensions[d + 1];
+            dimensionRows[d] = dimensionRows[d + 1];
+            dimensionValues[d] = dimensionValues[d + 1];
+            for (size_t v = 0; v < max_poly_voices; ++v)
+                dimensionCursors[v * max_row_dimensions + d] =
+                    dimensionCursors[v * max_row_dimensions + d + 1];
+        }
+        --numDimensions;
+    }
+    // Applies the parameters that differ from the previously applied ones, so that values
+    // the engine changes itself, like mutated transforms, are only overridden when the host
+    // actually changes the parameter. Returns true if anything changed.
+    bool applyParameters(const EngineParameters &pars)
+    {
+        if (pars == lastParameters)
+            return false;
+        for (size_t rid = 0; rid < RID_LAST; ++rid)
+        {
+            for (size_t v = 0; v < max_poly_voices; ++v)
+            {
+                if (pars.transforms[rid][v] != lastParameters.transforms[rid][v])
+                {
+                    voices[v].rowIterators[rid].transform = pars.transforms[rid][v];
+                    invalidateCycleCache(v);
+                }
+            }
+            if (pars.rowRepeats[rid] != lastParameters.rowRepeats[rid])
+                setRowRepeats(rid, pars.rowRepeats[rid]);
+            if (pars.mutations[rid] != lastParameters.mutations[rid])
+                mutationSettings[rid] = pars.mutations[rid];
+        }
+        if (pars.numActiveVoices != lastParameters.numActiveVoices)
+        {
+            num_active_voices = std::clamp<size_t>(pars.numActiveVoices, 1, max_poly_voices);
+            send_ui_updates = true;
+        }
+        if (pars.velocityLow != velocityLow)
+            invalidateCycleCaches();
+        velocityLow = pars.velocityLow;
+        selfSequence = pars.selfSequence;
+        lastParameters = pars;
+        return true;
+    }
+    // Sets how many times each element of a row is repeated before advancing, for all voices
+    void setRowRepeats(size_t rid, size_t repeats)
+    {
+        rowRepeats[rid] = std::max<size_t>(repeats, 1);
+        for (auto &v : voices)
+            v.rowIterators[rid].repetitions = rowRepeats[rid];
+        invalidateCycleCaches();
+    }
+    // Must be called after changing the voices' row iterators from outside the engine
+    void invalidateCycleCaches()
+    {
+        for (size_t v = 0; v < max_poly_voices; ++v)
+            invalidateCycleCache(v);
+    }
+    // Restarts the random sequence used for the row mutations
+    void setMutationSeed(uint64_t seed) { mutationRng.setSeed(seed); }
+    // Advances the sequencer by numSamples and leaves the generated events in outputEvents
+    void processBlock(int numSamples) { processBlockImpl(numSamples, nullptr); }
+    // Processes the block with the voice timing of another engine instead of advancing the
+    // voices, so that both end the block in the same timing state
+    void processBlockFollowing(int numSamples, const PulseBlock &timing)
+    {
+        processBlockImpl(numSamples, &timing);
+    }
+    // Replaces a row from outside the editor, also updating the editor
+    void replaceRow(size_t rid, const Row &row)
+    {
+        if (rid >= RID_LAST || row.num_active_entries == 0 ||
+            row.num_active_entries > Row::maxElements)
+            return;
+        setRow(rid, row);
+        notifyRowChanged(rid, -1);
+    }
+
+    std::array<Row, RID_LAST> rows;
+    std::array<size_t, RID_LAST> rowRepeats;
+    std::array<Voice, max_poly_voices> voices;
+    size_t num_active_voices = 2;
+    int velocityLow = 64;
+    int notelen = 11025;
+    double sampleRate = 44100.0;
+    double bpm = 120.0;
+    struct NoteInfo
+    {
+        int chan = 0;
+        int note = 0;
+        int duration = 0;
+    };
+    std::vector<NoteInfo> playingNotes;
+    std::vector<SequencerEvent> outputEvents;
+    EngineParameters lastParameters;
+    std::array<RowMutationSettings, RID_LAST> mutationSettings;
+    Xoshiro256 mutationRng;
+    // Written by a RowPlaylistFeeder, consumed at the row cycle boundaries
+    std::array<playlist_fifo_t, RID_LAST> playlistQueues;
+    // 0 when the dimension has no playlist, or its playlist has ended
+    std::array<std::atomic<uint32_t>, RID_LAST> playlistGenerations{};
+    // The generations as loaded at the start of the block, for the session log
+    std::array<uint32_t, RID_LAST> blockGenerations{};
+    struct PlaylistSwitch
+    {
+        size_t rid = 0;
+        PlaylistRow row;
+    };
+    // The playlist rows switched to during the last block, for the session log
+    std::vector<PlaylistSwitch> playlistSwitches;
+    // The runtime dimensions. The voices' positions in them are kept in one flat table indexed
+    // by voice * max_row_dimensions + dimension, and the row values are mapped to the output
+    // range when a dimension is set, so a trigger steps all of them in one pass of lookups.
+    struct DimensionCursor
+    {
+        uint16_t pos = 0;
+        uint16_t repetitionCounter = 0;
+    };
+    std::array<RowDimension, max_row_dimensions> dimensions;
+    std::array<Row, max_row_dimensions> dimensionRows;
+    std::array<std::array<int16_t, Row::maxElements>, max_row_dimensions> dimensionValues{};
+    std::array<DimensionCursor, max_poly_voices * max_row_dimensions> dimensionCursors{};
+    size_t numDimensions = 0;
+    // Off only to compare the output against the uncached path
+    bool cycleCacheEnabled = true;
+    // Set while locked to a shared clock, see processBlockImpl
+    bool clockAllVoices = false;
+    // The voice timing after the last block, published to the engines following this one
+    PulseBlock lastPulseBlock;
+    choc::fifo::SingleReaderSingleWriterFIFO<MessageToUI> fifo_to_ui;
+    // Read by the editor, written once per block with triggers. The constant size snapshot
+    // can't overflow like a message per trigger could when the editor falls behind.
+    SeqlockValue<PlaybackState> playbackState;
+    // The rows for an editor that opens while the engine runs, written whenever a row changes.
+    // After that the editor follows the OP_RowChanged messages.
+    std::array<SeqlockValue<Row>, RID_LAST> rowSnapshots;
+    std::atomic<bool> send_ui_updates{false};
+    std::atomic<bool> selfSequence{true};
+
+  private:
+    void processBlockImpl(int numSamples, const PulseBlock *timing)
+    {
+        RM_TRACE_SCOPE("engine processBlock");
+        assert(num_active_voices <= max_poly_voices);
+        outputEvents.clear();
+        playlistSwitches.clear();
+        // Hosts may call with empty blocks, which would also leave no sample for the offsets
+        if (numSamples <= 0)
+            return;
+        std::array<int, max_poly_voices> triggerstatuses;
+        std::fill(triggerstatuses.begin(), triggerstatuses.end(), 0);
+        std::array<int, max_poly_voices> triggeroffsets{};
+        // The notes playing from earlier blocks are released first, so that at the same offset
+        // the note offs come before the note ons
+        const size_t numOldNotes = playingNotes.size();
+        releaseNotes(0, numOldNotes, numSamples);
+        // Locked to a shared clock, all the voices keep time so that engines with different
+        // voice counts share the same timing
+        const size_t clockedVoices =
+            (clockAllVoices || timing) ? max_poly_voices : num_active_voices;
+        // The playlists and mutations change the rows and transforms at the row cycle ends,
+        // so with either active the notes are always stepped from the iterators
+        bool cacheable = cycleCacheEnabled;
+        for (size_t rid = 0; rid < RID_LAST; ++rid)
+        {
+            blockGenerations[rid] = playlistGenerations[rid];
+            if (blockGenerations[rid] != 0 || mutationSettings[rid].isActive())
+                cacheable = false;
+        }
+        if (timing)
+        {
+            for (size_t j = 0; j < max_poly_voices; ++j)
+            {
+                triggerstatuses[j] = timing->triggers[j];
+                triggeroffsets[j] = std::clamp(timing->offsets[j], 0, numSamples - 1);
+            }
+        }
+        else if (selfSequence)
+        {
+            for (size_t j = 0; j < clockedVoices; ++j)
+                advanceVoice(voices[j], numSamples, triggerstatuses[j], triggeroffsets[j]);
+        }
+        if (send_ui_updates)
+        {
+            MessageToUI msg;
+            msg.opcode = MessageToUI::OP_VoiceCountChanged;
+            msg.par0 = num_active_voices;
+            fifo_to_ui.push(msg);
+            send_ui_updates = false;
+        }
+        for (size_t i = 0; i < clockedVoices; ++i)
+        {
+            if (triggerstatuses[i] == 1 || triggerstatuses[i] == 2)
+            {
+                if (i >= num_active_voices)
+                {
+                    // silent voice, only keeping time
+                    updatePulseLength(voices[i]);
+                    voices[i].rowIterators[RID_DELTATIME].wrapped = false;
+                    invalidateCycleCache(i);
+                    continue;
+                }
+                for (size_t rid = 0; rid < RID_LAST; ++rid)
+                    currentPlayback.playpositions[i][rid] = voices[i].rowIterators[rid].pos;
+                ++currentPlayback.triggerCounts[i];
+                playbackChanged = true;
+
+                SequencerEvent noteon;
+                noteon.type = SequencerEvent::NoteOn;
+                if (cacheable && cycleCaches[i].state == CycleCache::Ready)
+                    replayCycleStep(i, noteon);
+                else
+                    stepRows(i, cacheable, noteon);
+                const uint32_t offset = triggeroffsets[i];
+                noteon.offset = offset;
+                const int note = noteon.note;
+                currentPlayback.soundingPitches[i] = note;
+                uint8_t chan = 1 + i;
+                int lentouse = notelen;
+                if (numDimensions > 0)
+                {
+                    std::array<int16_t, max_row_dimensions> dimvalues;
+                    stepDimensions(i, dimvalues);
+                    // The channel and length first, so that the controllers go to the channel
+                    // of the note
+                    for (size_t d = 0; d < numDimensions; ++d)
+                    {
+                        if (dimensions[d].target == DimensionTarget::MidiChannel)
+                            chan = dimvalues[d];
+                        else if (dimensions[d].target == DimensionTarget::NoteLength)
+                            lentouse = dimvalues[d] * sixteenthLength();
+                    }
+                    for (size_t d = 0; d < numDimensions; ++d)
+                    {
+                        if (dimensions[d].target == DimensionTarget::ControlChange)
+                            outputEvents.push_back({offset, SequencerEvent::ControlChange, chan,
+                                                    dimensions[d].controller,
+                                                    (uint8_t)dimvalues[d]});
+                    }
+                }
+                for (size_t rid = 0; rid < RID_LAST; ++rid)
+                {
+                    auto &it = voices[i].rowIterators[rid];
+                    if (it.wrapped)
+                    {
+                        it.wrapped = false;
+                        // Like the mutations, the shared row follows the cycles of the first voice
+                        if (i == 0)
+                            advancePlaylist(rid);
+                        if (mutationSettings[rid].isActive())
+                            mutateAtCycleEnd(i, rid);
+                    }
+                }
+                RM_TRACE_INSTANT("note trigger", note);
+                noteon.chan = chan;
+                outputEvents.push_back(noteon);
+                if (triggerstatuses[i] == 1)
+                    lentouse = 100000000;
+                // counted from the block start like the other notes, until the block ends
+                playingNotes.push_back({int(chan), note, int(offset) + lentouse});
+            }
+        }
+        if (timing)
+        {
+            for (size_t j = 0; j < max_poly_voices; ++j)
+            {
+                voices[j].playpos = timing->playpos[j];
+                voices[j].pulselen = timing->pulselen[j];
+            }
+        }
+        for (size_t j = 0; j < max_poly_voices; ++j)
+        {
+            lastPulseBlock.triggers[j] = triggerstatuses[j];
+            lastPulseBlock.offsets[j] = triggeroffsets[j];
+            lastPulseBlock.playpos[j] = voices[j].playpos;
+            lastPulseBlock.pulselen[j] = voices[j].pulselen;
+        }
+        // notes shorter than the rest of the block end within it
+        releaseNotes(numOldNotes, playingNotes.size(), numSamples);
+        std::erase_if(playingNotes, [](const auto &t) { return t.chan == -1; });
+        if (playbackChanged)
+        {
+            playbackState.write(currentPlayback);
+            playbackChanged = false;
+        }
+    }
+    // Steps the built in rows of a voice for a trigger. While cacheable, the steps are also
+    // recorded, until they have covered the combined period of the rows and the cache can be
+    // replayed instead.
+    void stepRows(size_t i, bool cacheable, SequencerEvent &noteon)
+    {
+        auto &v = voices[i];
+        auto &cache = cycleCaches[i];
+        if (!cacheable)
+            cache.state = CycleCache::Idle;
+        else if (cache.state == CycleCache::Idle)
+            startCycleRecording(i);
+        if (cache.state == CycleCache::Recording)
+        {
+            CycleStep step;
+            for (size_t rid = 0; rid < RID_LAST; ++rid)
+            {
+                step.positions[rid] = v.rowIterators[rid].pos;
+                step.counters[rid] = v.rowIterators[rid].repetition_counter;
+            }
+            cache.steps.push_back(step);
+        }
+        int polyat = v.rowIterators[RID_POLYAT].next();
+        const int polyatlen = rows[RID_POLYAT].num_active_entries;
+        noteon.pressure =
+            polyatlen > 1 ? uint32_t(std::lround(0xffffffff * (double)polyat / (polyatlen - 1)))
+                          : 0;
+        updatePulseLength(v);
+        int octave = v.rowIterators[RID_OCTAVE].next() - 3;
+        const int pclen = rows[RID_PITCHCLASS].num_active_entries;
+        const int pc = v.rowIterators[RID_PITCHCLASS].next();
+        // long pitch class and octave rows can go outside the MIDI note range
+        noteon.note = std::clamp(60 + octave * pclen + pc, 0, 127);
+        // The pitch classes are semitones, so the MIDI 2.0 pitch is the note number
+        noteon.pitch = uint16_t(noteon.note << 9);
+        // The 16-bit velocity spans the full range, the MIDI 1.0 velocity is scaled down from it
+        // as in the MIDI 2.0 specification, where a note on can't get velocity 0
+        float velo = mapToVelocity(v.rowIterators[RID_VELOCITY].next());
+        noteon.velocity16 =
+            (uint16_t)std::clamp<long>(std::lround(velo / 127.0f * 65535.0f), 0, 65535);
+        noteon.velocity = (uint8_t)std::max(noteon.velocity16 >> 9, 1);
+        if (cache.state != CycleCache::Recording)
+            return;
+        auto &step = cache.steps.back();
+        step.pulselen = v.pulselen;
+        step.noteOn = noteon;
+        if (cache.steps.size() < cache.period)
+            return;
+        // Back at the recorded start, unless something changed the iterators on the way
+        cache.state = CycleCache::Ready;
+        for (size_t rid = 0; rid < RID_LAST; ++rid)
+        {
+            if (v.rowIterators[rid].pos != cache.steps[0].positions[rid] ||
+                v.rowIterators[rid].repetition_counter != cache.steps[0].counters[rid])
+                cache.state = CycleCache::Idle;
+        }
+        cache.phase = 0;
+    }
+    void startCycleRecording(size_t i)
+    {
+        auto &cache = cycleCaches[i];
+        size_t period = 1;
+        for (size_t rid = 0; rid < RID_LAST; ++rid)
+        {
+            const auto &it = voices[i].rowIterators[rid];
+            // The iterators play their first element once more when they start, so the
+            // recording waits until they're all in their repeating cycle
+            if (it.repetition_counter < 1 || it.repetition_counter > it.repetitions)
+                return;
+            period = std::lcm(period, size_t(rows[rid].num_active_entries) * it.repetitions);
+            if (period > max_cycle_cache_steps)
+            {
+                cache.state = CycleCache::TooLong;
+                return;
+            }
+        }
+        cache.steps.clear();
+        cache.period = period;
+        cache.state = CycleCache::Recording;
+    }
+    // Plays the next step of the cache, leaving the iterators where stepping them would have
+    void replayCycleStep(size_t i, SequencerEvent &noteon)
+    {
+        auto &v = voices[i];
+        auto &cache = cycleCaches[i];
+        const auto &step = cache.steps[cache.phase];
+        if (++cache.phase == cache.steps.size())
+            cache.phase = 0;
+        const auto &nextstep = cache.steps[cache.phase];
+        for (size_t rid = 0; rid < RID_LAST; ++rid)
+        {
+            v.rowIterators[rid].pos = nextstep.positions[rid];
+            v.rowIterators[rid].repetition_counter = nextstep.counters[rid];
+        }
+        v.pulselen = step.pulselen;
+        noteon = step.noteOn;
+    }
+    void invalidateCycleCache(size_t i) { cycleCaches[i].state = CycleCache::Idle; }
+    void updatePulseLength(Voice &v)
+    {
+        double plen = (1 + v.rowIterators[RID_DELTATIME].next());
+        plen = (60.0 / bpm / 4.0) * plen;
+        v.pulselen = static_cast<int>(sampleRate * plen);
+    }
+    int sixteenthLength() const { return static_cast<int>(sampleRate * (60.0 / bpm / 4.0)); }
+    void updateDimensionValues(size_t index)
+    {
+        const auto &dim = dimensions[index];
+        const auto &row = dimensionRows[index];
+        const int len = row.num_active_entries;
+        int lowest = 0;
+        int highest = 127;
+        if (dim.target == DimensionTarget::NoteLength)
+        {
+            lowest = 1;
+            highest = 64;
+        }
+        else if (dim.target == DimensionTarget::MidiChannel)
+        {
+            lowest = 1;
+            highest = 16;
+        }
+        for (size_t i = 0; i < Row::maxElements; ++i)
+        {
+            int entry = std::min<int>(row.entries[i], len - 1);
+            int value = dim.low;
+            if (len > 1)
+                value += (int)std::lround((dim.high - dim.low) * (double)entry / (len - 1));
+            dimensionValues[index][i] = std::clamp(value, lowest, highest);
+        }
+    }
+    // Steps all the runtime dimensions of a voice, in one pass over its part of the cursor table
+    void stepDimensions(size_t voiceIndex, std::array<int16_t, max_row_dimensions> &values)
+    {
+        auto *cursors = &dimensionCursors[voiceIndex * max_row_dimensions];
+        for (size_t d = 0; d < numDimensions; ++d)
+        {
+            auto &c = cursors[d];
+            values[d] = dimensionValues[d][c.pos];
+            if (++c.repetitionCounter >= dimensions[d].repeats)
+            {
+                c.repetitionCounter = 0;
+                if (++c.pos >= dimensionRows[d].num_active_entries)
+                    c.pos = 0;
+            }
+        }
+    }
+    void setRow(size_t rid, const Row &row)
+    {
+        rows[rid] = row;
+        rowSnapshots[rid].write(row);
+        // The row may have become shorter, so keep all the voices' positions within it
+        for (auto &v : voices)
+            v.rowIterators[rid].pos %= row.num_active_entries;
+        invalidateCycleCaches();
+    }
+    // Switches to the next prepared playlist row, if there is one. The rows were prepared by
+    // the feeder, so this is only a queue pop and a copy of the fixed size row.
+    void advancePlaylist(size_t rid)
+    {
+        PlaylistRow pr;
+        while (playlistQueues[rid].pop(pr))
+        {
+            if (pr.generation != playlistGenerations[rid])
+                continue;
+            RM_TRACE_INSTANT("playlist row", pr.index);
+            setRow(rid, pr.row);
+            // The row stays, but the dimension no longer has a playlist. A playlist set in the
+            // meantime has a new generation, which is kept.
+            if (pr.last)
+            {
+                uint32_t generation = pr.generation;
+                playlistGenerations[rid].compare_exchange_strong(generation, 0);
+            }
+            if (playlistSwitches.size() < playlistSwitches.capacity())
+                playlistSwitches.push_back({rid, pr});
+            notifyRowChanged(rid, pr.index);
+            return;
+        }
+    }
+    // Sends the current row to the editor, with the playlist index or -1
+    void notifyRowChanged(size_t rid, int playlistIndex)
+    {
+        MessageToUI msg;
+        msg.opcode = MessageToUI::OP_RowChanged;
+        msg.par0 = rid;
+        msg.par1 = playlistIndex;
+        msg.row = rows[rid];
+        fifo_to_ui.push(msg);
+    }
+    // Runs on the audio thread, so this only does a few random draws and in place changes
+    void mutateAtCycleEnd(size_t voiceIndex, size_t rid)
+    {
+        const auto &ms = mutationSettings[rid];
+        auto &row = rows[rid];
+        auto &it = voices[voiceIndex].rowIterators[rid];
+        const uint16_t len = row.num_active_entries;
+        if (len < 2)
+            return;
+        if (ms.newTransform > 0.0f && mutationRng.nextFloat() < ms.newTransform)
+        {
+            uint32_t r = mutationRng.nextBelow(4 * len);
+            it.transform = {uint16_t(r >> 2), (r & 1) != 0, (r & 2) != 0};
+            invalidateCycleCache(voiceIndex);
+            // The host parameter keeps its value, the editor shows what the voice plays
+            MessageToUI msg;
+            msg.opcode = MessageToUI::OP_TransformChanged;
+            msg.par0 = rid;
+            msg.par1 = voiceIndex;
+            msg.transform = it.transform;
+            fifo_to_ui.push(msg);
+        }
+        // The row is shared, so it's only changed at the cycles of the first voice
+        if (voiceIndex != 0)
+            return;
+        bool rowChanged = false;
+        if (ms.rotate > 0.0f && mutationRng.nextFloat() < ms.rotate)
+        {
+            row.rotate(1 + mutationRng.nextBelow(len - 1));
+            rowChanged = true;
+        }
+        if (ms.swapPair > 0.0f && mutationRng.nextFloat() < ms.swapPair)
+        {
+            uint32_t a = mutationRng.nextBelow(len);
+            uint32_t b = (a + 1 + mutationRng.nextBelow(len - 1)) % len;
+            row.swap_entries(a, b);
+            rowChanged = true;
+        }
+        // only multiplied when the factor is coprime with the row length
+        if (ms.multiply > 0.0f && mutationRng.nextFloat() < ms.multiply)
+            rowChanged |= row.multiply(mutationRng.nextBelow(2) == 0 ? 5 : 7);
+        if (rowChanged)
+        {
+            rowSnapshots[rid].write(row);
+            notifyRowChanged(rid, -1);
+            invalidateCycleCaches();
+        }
+    }
+    // Emits the note offs of the playing notes in [begin, end) that end within this block, at
+    // their sample offsets. The durations of the others are made relative to the next block.
+    void releaseNotes(size_t begin, size_t end, int numSamples)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            auto &pm = playingNotes[i];
+            if (pm.duration >= numSamples)
+            {
+                pm.duration -= numSamples;
+                continue;
+            }
+            outputEvents.push_back({(uint32_t)std::max(pm.duration, 0), SequencerEvent::NoteOff,
+                                    (uint8_t)pm.chan, (uint8_t)pm.note, 0});
+            pm.chan = -1;
+        }
+    }
+    // Advances the voice play position by numSamples and flags a trigger if the position passes
+    // the pulse start, with the sample offset where it does. This is the closed form of stepping
+    // the position one sample at a time, so the cost doesn't depend on the block size.
+    static void advanceVoice(Voice &v, int numSamples, int &triggerstatus, int &triggeroffset)
+    {
+        int pulselen = std::max(v.pulselen, 1);
+        // pulselen can become shorter than the current position when it's recalculated at the
+        // trigger, in which case the position wraps on the next sample
+        int samplesToStart = 0;
+        if (v.playpos > 0)
+            samplesToStart = v.playpos >= pulselen ? 1 : pulselen - v.playpos;
+        if (samplesToStart < numSamples)
+        {
+            triggerstatus = 2;
+            triggeroffset = samplesToStart;
+        }
+        if (samplesToStart <= numSamples)
+            v.playpos = (numSamples - samplesToStart) % pulselen;
+        else
+            v.playpos += numSamples;
+    }
+    // Same mapping as juce::jmap from the velocity row range into velocityLow...127
+    float mapToVelocity(int rowvalue) const
+    {
+        float srcmax = rows[RID_VELOCITY].num_active_entries - 1;
+        if (srcmax <= 0.0f)
+            return velocityLow;
+        return velocityLow + (127.0f - velocityLow) * (rowvalue / srcmax);
+    }
+    PlaybackState currentPlayback;
+    bool playbackChanged = false;
+    // The combined output of the built in rows repeats after the least common multiple of
+    // their lengths times repeats. When that's short enough, one period of each voice's steps
+    // is recorded while it plays and then replayed, until a row, transform, repeat count or
+    // anything else the steps depend on changes.
+    struct CycleStep
+    {
+        // the iterator state before the step
+        std::array<int16_t, RID_LAST> positions;
+        std::array<uint16_t, RID_LAST> counters;
+        int pulselen = 0;
+        SequencerEvent noteOn;
+    };
+    struct CycleCache
+    {
+        enum State
+        {
+            Idle,
+            Recording,
+            Ready,
+            // the period is longer than max_cycle_cache_steps
+            TooLong
+        };
+        State state = Idle;
+        std::vector<CycleStep> steps;
+        size_t period = 0;
+        size_t phase = 0;
+    };
+    std::array<CycleCache, max_poly_voices> cycleCaches;
+};
+
+} // namespace xenakios
@@ -0,0 +1,792 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "sequencer_engine.h"
+#include "containers/choc_SingleReaderSingleWriterFIFO.h"
+
+namespace xenakios
+{
+
+// Compact binary session log of everything that affects the engine output : the initial engine
+// state, every message popped from the UI FIFO, parameter changes, the playlist rows switched
+// to, the timing taken from a shared clock and every processed block with its size, host
+// transport and a hash of the generated events. The log can be replayed headlessly with
+// replaySessionLog to check that the engine reproduces the recorded output.
+//
+// File layout : magic "RMLG", u32 version, engine state snapshot, then tagged records.
+// Integers are LEB128 varints, timestamps are deltas in samples from the previous record.
+
+class ByteWriter
+{
+  public:
+    explicit ByteWriter(std::vector<uint8_t> &dest) : data(dest) {}
+    void write_u8(uint8_t v) { data.push_back(v); }
+    void write_varint(uint64_t v)
+    {
+        while (v >= 0x80)
+        {
+            data.push_back(uint8_t(v | 0x80));
+            v >>= 7;
+        }
+        data.push_back(uint8_t(v));
+    }
+    // zigzag encoded so that small negative values stay small
+    void write_svarint(int64_t v) { write_varint((uint64_t(v) << 1) ^ uint64_t(v >> 63)); }
+    void write_f64(double v)
+    {
+        uint64_t bits = 0;
+        std::memcpy(&bits, &v, sizeof(double));
+        for (int i = 0; i < 8; ++i)
+            data.push_back(uint8_t(bits >> (i * 8)));
+    }
+    void write_u32(uint32_t v)
+    {
+        for (int i = 0; i < 4; ++i)
+            data.push_back(uint8_t(v >> (i * 8)));
+    }
+    std::vector<uint8_t> &data;
+};
+
+class ByteReader
+{
+  public:
+    ByteReader(const uint8_t *d, size_t sz) : data(d), size(sz) {}
+    bool atEnd() const { return pos >= size; }
+    bool failed = false;
+    uint8_t read_u8()
+    {
+        if (pos >= size)
+        {
+            failed = true;
+            return 0;
+        }
+        return data[pos++];
+    }
+    uint64_t read_varint()
+    {
+        uint64_t result = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            uint8_t b = read_u8();
+            result |= uint64_t(b & 0x7f) << shift;
+            if ((b & 0x80) == 0 || failed)
+                return result;
+        }
+        failed = true;
+        return result;
+    }
+    int64_t read_svarint()
+    {
+        uint64_t v = read_varint();
+        return int64_t(v >> 1) ^ -int64_t(v & 1);
+    }
+    double read_f64()
+    {
+        uint64_t bits = 0;
+        for (int i = 0; i < 8; ++i)
+            bits |= uint64_t(read_u8()) << (i * 8);
+        double result = 0.0;
+        std::memcpy(&result, &bits, sizeof(double));
+        return result;
+    }
+    uint32_t read_u32()
+    {
+        uint32_t result = 0;
+        for (int i = 0; i < 4; ++i)
+            result |= uint32_t(read_u8()) << (i * 8);
+        return result;
+    }
+
+  private:
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    size_t pos = 0;
+};
+
+inline void write_row(ByteWriter &w, const Row &row)
+{
+    w.write_u8(row.num_active_entries);
+    for (size_t i = 0; i < row.num_active_entries; ++i)
+        w.write_u8(row.entries[i]);
+}
+
+inline void read_row(ByteReader &r, Row &row)
+{
+    row.num_active_entries = std::min<uint16_t>(r.read_u8(), Row::maxElements);
+    for (size_t i = 0; i < row.num_active_entries; ++i)
+        row.entries[i] = r.read_u8();
+}
+
+inline void write_transform(ByteWriter &w, const RowTransform &t)
+{
+    w.write_varint(t.transpose);
+    w.write_u8(uint8_t(t.inverted) | (uint8_t(t.reversed) << 1));
+}
+
+inline void read_transform(ByteReader &r, RowTransform &t)
+{
+    t.transpose = r.read_varint();
+    auto flags = r.read_u8();
+    t.inverted = flags & 1;
+    t.reversed = flags & 2;
+}
+
+inline void write_dimension(ByteWriter &w, const RowDimension &dim)
+{
+    w.write_u8((uint8_t)dim.target);
+    w.write_u8(dim.controller);
+    w.write_svarint(dim.low);
+    w.write_svarint(dim.high);
+    w.write_varint(dim.repeats);
+}
+
+inline void read_dimension(ByteReader &r, RowDimension &dim)
+{
+    dim.target = DimensionTarget(std::min<uint8_t>(r.read_u8(), 2));
+    dim.controller = r.read_u8() & 0x7f;
+    dim.low = r.read_svarint();
+    dim.high = r.read_svarint();
+    dim.repeats = r.read_varint();
+}
+
+inline void write_mutation(ByteWriter &w, const RowMutationSettings &ms)
+{
+    w.write_f64(ms.newTransform);
+    w.write_f64(ms.rotate);
+    w.write_f64(ms.swapPair);
+    w.write_f64(ms.multiply);
+}
+
+inline void read_mutation(ByteReader &r, RowMutationSettings &ms)
+{
+    ms.newTransform = r.read_f64();
+    ms.rotate = r.read_f64();
+    ms.swapPair = r.read_f64();
+    ms.multiply = r.read_f64();
+}
+
+inline void write_parameters(ByteWriter &w, const EngineParameters &pars)
+{
+    for (size_t rid = 0; rid < RID_LAST; ++rid)
+    {
+        for (auto &t : pars.transforms[rid])
+            write_transform(w, t);
+        w.write_varint(pars.rowRepeats[rid]);
+        write_mutation(w, pars.mutations[rid]);
+    }
+    w.write_varint(pars.numActiveVoices);
+    w.write_svarint(pars.velocityLow);
+    w.write_u8(pars.selfSequence);
+}
+
+inline void read_parameters(ByteReader &r, EngineParameters &pars)
+{
+    for (size_t rid = 0; rid < RID_LAST; ++rid)
+    {
+        for (auto &t : pars.transforms[rid])
+            read_transform(r, t);
+        pars.rowRepeats[rid] = r.read_varint();
+        read_mutation(r, pars.mutations[rid]);
+    }
+    pars.numActiveVoices = r.read_varint();
+    pars.velocityLow = r.read_svarint();
+    pars.selfSequence = r.read_u8() != 0;
+}
+
+// Upper bound of the serialized engine state size, used to preallocate the snapshot buffer
+// so that the snapshot can be taken on the audio thread
+constexpr size_t max_engine_state_bytes =
+    8192 + 1024 * 3 * 10 + max_row_dimensions * (64 + max_poly_voices * 6);
+
+inline void write_engine_state(ByteWriter &w, const SequencerEngine &eng)
+{
+    w.write_f64(eng.sampleRate);
+    w.write_varint(eng.num_active_voices);
+    w.write_svarint(eng.velocityLow);
+    w.write_svarint(eng.notelen);
+    w.write_u8(eng.selfSequence.load());
+    for (size_t i = 0; i < RID_LAST; ++i)
+    {
+        write_row(w, eng.rows[i]);
+        w.write_varint(eng.rowRepeats[i]);
+    }
+    for (auto &v : eng.voices)
+    {
+        w.write_svarint(v.playpos);
+        w.write_svarint(v.pulselen);
+        w.write_svarint(v.notelen);
+        w.write_svarint(v.outchan);
+        for (auto &it : v.rowIterators)
+        {
+            write_transform(w, it.transform);
+            w.write_svarint(it.repetitions);
+            w.write_svarint(it.repetition_counter);
+            w.write_svarint(it.pos);
+        }
+    }
+    w.write_varint(eng.numDimensions);
+    for (size_t d = 0; d < eng.numDimensions; ++d)
+    {
+        write_dimension(w, eng.dimensions[d]);
+        write_row(w, eng.dimensionRows[d]);
+        for (size_t v = 0; v < max_poly_voices; ++v)
+        {
+            auto &c = eng.dimensionCursors[v * max_row_dimensions + d];
+            w.write_varint(c.pos);
+            w.write_varint(c.repetitionCounter);
+        }
+    }
+    write_parameters(w, eng.lastParameters);
+    for (auto &ms : eng.mutationSettings)
+        write_mutation(w, ms);
+    for (auto st : eng.mutationRng.state)
+        w.write_varint(st);
+    size_t numnotes = std::min<size_t>(eng.playingNotes.size(), 1024);
+    w.write_varint(numnotes);
+    for (size_t i = 0; i < numnotes; ++i)
+    {
+        w.write_svarint(eng.playingNotes[i].chan);
+        w.write_svarint(eng.playingNotes[i].note);
+        w.write_svarint(eng.playingNotes[i].duration);
+    }
+}
+
+inline void read_engine_state(ByteReader &r, SequencerEngine &eng)
+{
+    eng.sampleRate = r.read_f64();
+    eng.num_active_voices = std::min<size_t>(r.read_varint(), max_poly_voices);
+    eng.velocityLow = r.read_svarint();
+    eng.notelen = r.read_svarint();
+    eng.selfSequence = r.read_u8() != 0;
+    for (size_t i = 0; i < RID_LAST; ++i)
+    {
+        read_row(r, eng.rows[i]);
+        eng.rowRepeats[i] = r.read_varint();
+    }
+    for (auto &v : eng.voices)
+    {
+        v.playpos = r.read_svarint();
+        v.pulselen = r.read_svarint();
+        v.notelen = r.read_svarint();
+        v.outchan = r.read_svarint();
+        for (size_t i = 0; i < RID_LAST; ++i)
+        {
+            auto &it = v.rowIterators[i];
+            RowTransform t;
+            read_transform(r, t);
+            it = Row::Iterator(eng.rows[i], t);
+            it.repetitions = r.read_svarint();
+            it.repetition_counter = r.read_svarint();
+            it.pos = r.read_svarint();
+        }
+    }
+    eng.invalidateCycleCaches();
+    eng.numDimensions = 0;
+    size_t numdims = std::min<size_t>(r.read_varint(), max_row_dimensions);
+    for (size_t d = 0; d < numdims; ++d)
+    {
+        RowDimension dim;
+        Row row;
+        read_dimension(r, dim);
+        read_row(r, row);
+        if (!eng.setDimension(d, dim, row))
+            r.failed = true;
+        for (size_t v = 0; v < max_poly_voices; ++v)
+        {
+            auto &c = eng.dimensionCursors[v * max_row_dimensions + d];
+            c.pos = r.read_varint() % std::max<uint16_t>(row.num_active_entries, 1);
+            c.repetitionCounter = r.read_varint();
+        }
+    }
+    read_parameters(r, eng.lastParameters);
+    for (auto &ms : eng.mutationSettings)
+        read_mutation(r, ms);
+    for (auto &st : eng.mutationRng.state)
+        st = r.read_varint();
+    eng.playingNotes.clear();
+    size_t numnotes = std::min<size_t>(r.read_varint(), 1024);
+    for (size_t i = 0; i < numnotes; ++i)
+    {
+        SequencerEngine::NoteInfo ni;
+        ni.chan = r.read_svarint();
+        ni.note = r.read_svarint();
+        ni.duration = r.read_svarint();
+        eng.playingNotes.push_back(ni);
+    }
+}
+
+inline void write_pulse_block(ByteWriter &w, const PulseBlock &pulse)
+{
+    for (size_t i = 0; i < max_poly_voices; ++i)
+    {
+        w.write_u8(pulse.triggers[i]);
+        w.write_varint(pulse.offsets[i]);
+        w.write_svarint(pulse.playpos[i]);
+        w.write_svarint(pulse.pulselen[i]);
+    }
+}
+
+inline void read_pulse_block(ByteReader &r, PulseBlock &pulse)
+{
+    for (size_t i = 0; i < max_poly_voices; ++i)
+    {
+        pulse.triggers[i] = r.read_u8();
+        pulse.offsets[i] = r.read_varint();
+        pulse.playpos[i] = r.read_svarint();
+        pulse.pulselen[i] = r.read_svarint();
+    }
+}
+
+inline void write_message(ByteWriter &w, const MessageToProcessor &msg)
+{
+    w.write_u8(msg.opcode);
+    w.write_varint(msg.row_index);
+    write_row(w, msg.row);
+    if (msg.opcode == MessageToProcessor::OP_SetDimension)
+        write_dimension(w, msg.dimension);
+}
+
+inline void read_message(ByteReader &r, MessageToProcessor &msg)
+{
+    msg.opcode = (MessageToProcessor::Op)r.read_u8();
+    if (msg.opcode == MessageToProcessor::OP_ChangeRow)
+        msg.row_index = std::min<size_t>(r.read_varint(), RID_LAST - 1);
+    else
+        msg.row_index = std::min<size_t>(r.read_varint(), max_row_dimensions);
+    read_row(r, msg.row);
+    if (msg.opcode == MessageToProcessor::OP_SetDimension)
+        read_dimension(r, msg.dimension);
+}
+
+// FNV-1a over the block start time and the generated events, so that the log doesn't need to
+// store the full output
+inline uint64_t hash_events(const std::vector<SequencerEvent> &events, uint64_t sampleTime)
+{
+    uint64_t h = 14695981039346656037ULL;
+    auto add = [&h](uint64_t v) {
+        h ^= v;
+        h *= 1099511628211ULL;
+    };
+    add(sampleTime);
+    for (auto &e : events)
+    {
+        add(e.offset);
+        add(e.type);
+        add(e.chan);
+        add(e.note);
+        add(e.velocity);
+        add(e.velocity16);
+        add(e.pitch);
+        add(e.pressure);
+    }
+    return h;
+}
+
+struct SessionLogRecord
+{
+    enum Type : uint8_t
+    {
+        RT_None,
+        RT_Message,
+        RT_Block,
+        RT_Parameters,
+        // recorded after the block that switched to the row, replayed before it with the
+        // playlist generation of that block
+        RT_PlaylistRow,
+        // the voice timing of a block locked to a shared clock, replayed before the block
+        RT_PulseBlock,
+        // written last, with the number of blocks and dropped records of the whole recording
+        RT_End
+    };
+    Type type = RT_None;
+    uint64_t sampleTime = 0;
+    int numSamples = 0;
+    TransportInfo transport;
+    uint64_t outputHash = 0;
+    uint32_t numOutputEvents = 0;
+    // the block's sequence number and the records dropped so far, so that gaps can be detected
+    uint64_t blockIndex = 0;
+    uint64_t numDroppedRecords = 0;
+    // the playlist generations at the start of the block
+    std::array<uint32_t, RID_LAST> playlistGenerations{};
+    MessageToProcessor message;
+    EngineParameters parameters;
+    size_t playlistRowIndex = 0;
+    PulseBlock pulse;
+};
+
+constexpr uint32_t session_log_version = 10;
+
+// Records a session log. start/stop are called from the message thread, the capture and
+// record methods from the audio thread, where they only push into a preallocated FIFO.
+// A background thread does the encoding and file writing. The FIFO only exists while
+// recording, so an instance that never records doesn't hold its memory.
+class SessionRecorder
+{
+  public:
+    SessionRecorder() { snapshot.reserve(max_engine_state_bytes); }
+    ~SessionRecorder() { stop(); }
+    bool start(std::string path)
+    {
+        stop();
+        outstream.open(path, std::ios::binary);
+        if (!outstream.is_open())
+            return false;
+        records = std::make_unique<record_fifo_t>();
+        records->reset(fifoCapacity);
+        snapshot.clear();
+        snapshotTaken = false;
+        sampleTime = 0;
+        numBlocks = 0;
+        droppedRecords = 0;
+        state = ST_WaitingForSnapshot;
+        writerThread = std::thread([this]() { writerLoop(); });
+        return true;
+    }
+    void stop()
+    {
+        if (state == ST_Idle)
+            return;
+        state = ST_Idle;
+        while (audioThreadBusy)
+            std::this_thread::yield();
+        if (writerThread.joinable())
+            writerThread.join();
+        outstream.close();
+        // Nothing can push anymore at this point, so the FIFO can be freed safely
+        records.reset();
+    }
+    bool isRecording() const { return state != ST_Idle; }
+    uint64_t getNumDroppedRecords() const { return droppedRecords; }
+
+    // Audio thread : called at the start of each block before any messages are handled
+    void beginBlock(const SequencerEngine &eng)
+    {
+        audioThreadBusy = true;
+        if (state == ST_WaitingForSnapshot)
+        {
+            ByteWriter w(snapshot);
+            write_engine_state(w, eng);
+            snapshotTaken = true;
+            state = ST_Recording;
+        }
+    }
+    // Audio thread
+    void recordMessage(const MessageToProcessor &msg)
+    {
+        if (state != ST_Recording)
+            return;
+        SessionLogRecord rec;
+        rec.type = SessionLogRecord::RT_Message;
+        rec.sampleTime = sampleTime;
+        rec.message = msg;
+        if (!records->push(rec))
+            ++droppedRecords;
+    }
+    // Audio thread : called when the parameters applied to the engine have changed
+    void recordParameters(const EngineParameters &pars)
+    {
+        if (state != ST_Recording)
+            return;
+        SessionLogRecord rec;
+        rec.type = SessionLogRecord::RT_Parameters;
+        rec.sampleTime = sampleTime;
+        rec.parameters = pars;
+        if (!records->push(rec))
+            ++droppedRecords;
+    }
+    // Audio thread : called after a block that used the timing of a shared clock
+    void recordPulseBlock(const PulseBlock &pulse)
+    {
+        if (state != ST_Recording)
+            return;
+        SessionLogRecord rec;
+        rec.type = SessionLogRecord::RT_PulseBlock;
+        rec.sampleTime = sampleTime;
+        rec.pulse = pulse;
+        if (!records->push(rec))
+            ++droppedRecords;
+    }
+    // Audio thread : called after the engine has processed the block
+    void endBlock(int numSamples, const TransportInfo &transport, const SequencerEngine &eng)
+    {
+        if (state == ST_Recording)
+        {
+            for (const auto &ps : eng.playlistSwitches)
+            {
+                SessionLogRecord rec;
+                rec.type = SessionLogRecord::RT_PlaylistRow;
+                rec.sampleTime = sampleTime;
+                rec.playlistRowIndex = ps.rid;
+                rec.message.row = ps.row.row;
+                if (!records->push(rec))
+                    ++droppedRecords;
+            }
+            SessionLogRecord rec;
+            rec.type = SessionLogRecord::RT_Block;
+            rec.sampleTime = sampleTime;
+            rec.numSamples = numSamples;
+            rec.transport = transport;
+            rec.outputHash = hash_events(eng.outputEvents, sampleTime);
+            rec.numOutputEvents = eng.outputEvents.size();
+            rec.blockIndex = numBlocks++;
+            rec.numDroppedRecords = droppedRecords;
+            rec.playlistGenerations = eng.blockGenerations;
+            if (!records->push(rec))
+                ++droppedRecords;
+            sampleTime += numSamples;
+        }
+        audioThreadBusy = false;
+    }
+
+  private:
+    enum State
+    {
+        ST_Idle,
+        ST_WaitingForSnapshot,
+        ST_Recording
+    };
+    void writerLoop()
+    {
+        std::vector<uint8_t> buf;
+        buf.reserve(65536);
+        ByteWriter w(buf);
+        for (char c : std::string("RMLG"))
+            w.write_u8(c);
+        w.write_u32(session_log_version);
+        // The whole recording may already be over before this thread gets to run
+        while (!snapshotTaken && state != ST_Idle)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        if (!snapshotTaken)
+            return;
+        buf.insert(buf.end(), snapshot.begin(), snapshot.end());
+        uint64_t prevtime = 0;
+        SessionLogRecord rec;
+        while (true)
+        {
+            bool running = state != ST_Idle;
+            // A block that started before the recording was stopped can still push records
+            if (!running)
+            {
+                while (audioThreadBusy)
+                    std::this_thread::yield();
+            }
+            while (records->pop(rec))
+            {
+                w.write_u8(rec.type);
+                w.write_varint(rec.sampleTime - prevtime);
+                prevtime = rec.sampleTime;
+                if (rec.type == SessionLogRecord::RT_Message)
+                    write_message(w, rec.message);
+                if (rec.type == SessionLogRecord::RT_Parameters)
+                    write_parameters(w, rec.parameters);
+                if (rec.type == SessionLogRecord::RT_PulseBlock)
+                    write_pulse_block(w, rec.pulse);
+                if (rec.type == SessionLogRecord::RT_PlaylistRow)
+                {
+                    w.write_varint(rec.playlistRowIndex);
+                    write_row(w, rec.message.row);
+                }
+                if (rec.type == SessionLogRecord::RT_Block)
+                {
+                    w.write_varint(rec.numSamples);
+                    w.write_f64(rec.transport.bpm);
+                    w.write_f64(rec.transport.ppqpos);
+                    w.write_u8(rec.transport.isPlaying);
+                    w.write_varint(rec.outputHash);
+                    w.write_varint(rec.numOutputEvents);
+                    w.write_varint(rec.blockIndex);
+                    w.write_varint(rec.numDroppedRecords);
+                    for (auto generation : rec.playlistGenerations)
+                        w.write_varint(generation);
+                }
+            }
+            if (!running)
+                break;
+            outstream.write((const char *)buf.data(), buf.size());
+            buf.clear();
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        // Nothing is recorded anymore, so the audio thread's counters are final
+        w.write_u8(SessionLogRecord::RT_End);
+        w.write_varint(0);
+        w.write_varint(numBlocks);
+        w.write_varint(droppedRecords);
+        outstream.write((const char *)buf.data(), buf.size());
+        outstream.flush();
+    }
+    using record_fifo_t = choc::fifo::SingleReaderSingleWriterFIFO<SessionLogRecord>;
+    static constexpr size_t fifoCapacity = 16384;
+    std::unique_ptr<record_fifo_t> records;
+    std::vector<uint8_t> snapshot;
+    std::ofstream outstream;
+    std::thread writerThread;
+    std::atomic<State> state{ST_Idle};
+    std::atomic<bool> audioThreadBusy{false};
+    std::atomic<bool> snapshotTaken{false};
+    std::atomic<uint64_t> droppedRecords{0};
+    uint64_t sampleTime = 0;
+    uint64_t numBlocks = 0;
+};
+
+struct ReplayResult
+{
+    bool valid = false;
+    std::string error;
+    uint64_t numBlocks = 0;
+    uint64_t numMessages = 0;
+    uint64_t numSamples = 0;
+    uint64_t numMismatches = 0;
+    uint64_t firstMismatchSample = 0;
+};
+
+// Feeds a recorded session back through a fresh engine and compares the output of every block
+// against the recorded hashes. blockCallback, if given, is called after each processed block.
+template <typename BlockCallback>
+inline ReplayResult replaySessionLog(const std::vector<uint8_t> &logdata, SequencerEngine &eng,
+                                     BlockCallback &&blockCallback)
+{
+    ReplayResult result;
+    ByteReader r(logdata.data(), logdata.size());
+    char magic[4];
+    for (auto &c : magic)
+        c = r.read_u8();
+    if (std::memcmp(magic, "RMLG", 4) != 0 || r.read_u32() != session_log_version)
+    {
+        result.error = "not a Row Manager session log or unsupported version";
+        return result;
+    }
+    read_engine_state(r, eng);
+    uint64_t sampletime = 0;
+    MessageToProcessor msg;
+    PulseBlock pulse;
+    bool havePulse = false;
+    bool haveEnd = false;
+    std::vector<std::pair<size_t, PlaylistRow>> pendingPlaylistRows;
+    while (!r.atEnd() && !r.failed && !haveEnd)
+    {
+        auto type = r.read_u8();
+        sampletime += r.read_varint();
+        if (type == SessionLogRecord::RT_Message)
+        {
+            read_message(r, msg);
+            eng.handleMessage(msg);
+            ++result.numMessages;
+        }
+        else if (type == SessionLogRecord::RT_Parameters)
+        {
+            EngineParameters pars;
+            read_parameters(r, pars);
+            eng.applyParameters(pars);
+        }
+        else if (type == SessionLogRecord::RT_PulseBlock)
+        {
+            read_pulse_block(r, pulse);
+            havePulse = true;
+        }
+        else if (type == SessionLogRecord::RT_PlaylistRow)
+        {
+            // queued for the engine to switch to at the same cycle boundary as when recorded,
+            // once the generation of the block is known
+            auto &pending = pendingPlaylistRows.emplace_back();
+            pending.first = std::min<size_t>(r.read_varint(), RID_LAST - 1);
+            read_row(r, pending.second.row);
+            if (pending.second.row.num_active_entries == 0)
+            {
+                result.error = "invalid playlist row";
+                return result;
+            }
+        }
+        else if (type == SessionLogRecord::RT_Block)
+        {
+            TransportInfo transport;
+            int numsamples = r.read_varint();
+            transport.bpm = r.read_f64();
+            transport.ppqpos = r.read_f64();
+            transport.isPlaying = r.read_u8() != 0;
+            uint64_t hash = r.read_varint();
+            uint64_t numevents = r.read_varint();
+            uint64_t blockindex = r.read_varint();
+            uint64_t numdropped = r.read_varint();
+            std::array<uint32_t, RID_LAST> generations;
+            for (auto &generation : generations)
+                generation = r.read_varint();
+            if (r.failed)
+                break;
+            // The engine state can't be reconstructed past a lost record
+            if (blockindex != result.numBlocks || numdropped > 0)
+            {
+                result.error = std::format("records were dropped while recording, before block {}",
+                                           result.numBlocks);
+                return result;
+            }
+            // The live engine accepted exactly the recorded rows, whatever the feeder queued
+            // and however the playlists were changed during the block
+            for (size_t rid = 0; rid < RID_LAST; ++rid)
+                eng.playlistGenerations[rid] = generations[rid];
+            for (auto &[rid, pr] : pendingPlaylistRows)
+            {
+                pr.generation = generations[rid];
+                if (!eng.playlistQueues[rid].push(pr))
+                {
+                    result.error = "invalid playlist row";
+                    return result;
+                }
+            }
+            pendingPlaylistRows.clear();
+            eng.setTempo(transport.bpm);
+            if (havePulse)
+                eng.processBlockFollowing(numsamples, pulse);
+            else
+                eng.processBlock(numsamples);
+            havePulse = false;
+            if (hash != hash_events(eng.outputEvents, sampletime) ||
+                numevents != eng.outputEvents.size())
+            {
+                if (result.numMismatches == 0)
+                    result.firstMismatchSample = sampletime;
+                ++result.numMismatches;
+            }
+            blockCallback(numsamples, transport);
+            ++result.numBlocks;
+            result.numSamples += numsamples;
+        }
+        else if (type == SessionLogRecord::RT_End)
+        {
+            uint64_t numblocks = r.read_varint();
+            uint64_t numdropped = r.read_varint();
+            if (r.failed)
+                break;
+            if (numblocks != result.numBlocks || numdropped > 0)
+            {
+                result.error = std::format("{} of {} blocks and {} dropped records in the log",
+                                           result.numBlocks, numblocks, numdropped);
+                return result;
+            }
+            haveEnd = true;
+        }
+        else
+        {
+            result.error = "unknown record type";
+            return result;
+        }
+    }
+    if (r.failed || !haveEnd)
+    {
+        result.error = "log is truncated";
+        return result;
+    }
+    result.valid = true;
+    return result;
+}
+
+} // namespace xenakios
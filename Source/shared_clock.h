@@ -0,0 +1,160 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include "row_engine.h"
+#include "seqlock.h"
+#include "sequencer_engine.h"
+
+namespace xenakios
+{
+
+struct SharedPulse
+{
+    // the block start in the group sample time plus 1, so that 0 means no block
+    uint64_t tag = 0;
+    int numSamples = 0;
+    PulseBlock timing;
+};
+
+// The state shared by the engines of one group : the voice timing of the latest block and the
+// rows. The first member to process a block claims it and runs the timing, the others copy it.
+struct SharedClockGroup
+{
+    std::atomic<uint64_t> claimedTag{0};
+    SeqlockValue<SharedPulse> pulse;
+    std::array<SeqlockValue<Row>, RID_LAST> rows;
+};
+
+constexpr int max_shared_clock_groups = 16;
+
+// Process wide, so all the plugin instances loaded from the same binary see the same groups.
+// The groups are allocated statically, joining one is just taking its address.
+class SharedClockRegistry
+{
+  public:
+    static SharedClockRegistry &instance()
+    {
+        static SharedClockRegistry registry;
+        return registry;
+    }
+    // Groups are numbered from 1, 0 is no group
+    SharedClockGroup *getGroup(int index)
+    {
+        if (index < 1 || index > max_shared_clock_groups)
+            return nullptr;
+        return &groups[index - 1];
+    }
+
+  private:
+    SharedClockRegistry() = default;
+    std::array<SharedClockGroup, max_shared_clock_groups> groups;
+};
+
+// One engine's membership in a shared clock group. All methods are called from the audio
+// thread of the engine, once per block, in the order setGroup, pullRows, publishRow and
+// processBlock.
+class SharedClockClient
+{
+  public:
+    void setGroup(SequencerEngine &eng, int index)
+    {
+        if (index == groupIndex)
+            return;
+        groupIndex = index;
+        group = SharedClockRegistry::instance().getGroup(index);
+        eng.clockAllVoices = group != nullptr;
+        seenRowVersions.fill(0);
+        localTime = 0;
+        lastHostSampleTime = -1;
+        // Start by following the latest block, which may be from the current host callback.
+        // If it's from the previous one, this engine is one block behind and catches up on the
+        // next block like after missed blocks.
+        SharedPulse latest;
+        if (group && group->pulse.read(latest))
+            localTime = latest.tag - 1;
+    }
+    bool isInGroup() const { return group != nullptr; }
+    // Applies the rows the other members have changed, calling onRowChanged(rid, row) for each
+    template <typename Callback> void pullRows(SequencerEngine &eng, Callback &&onRowChanged)
+    {
+        if (!group)
+            return;
+        for (size_t rid = 0; rid < RID_LAST; ++rid)
+        {
+            auto &shared = group->rows[rid];
+            uint32_t version = shared.version();
+            if (version == seenRowVersions[rid])
+                continue;
+            Row row;
+            if (!shared.read(row))
+                continue;
+            seenRowVersions[rid] = version;
+            eng.replaceRow(rid, row);
+            onRowChanged(rid, row);
+        }
+    }
+    void publishRow(size_t rid, const Row &row)
+    {
+        if (!group || rid >= RID_LAST)
+            return;
+        group->rows[rid].write(row);
+        seenRowVersions[rid] = group->rows[rid].version();
+    }
+    // Processes the engine block, either running the voice timing for the group or following
+    // the timing another member already ran. The blocks are matched by the host sample time
+    // when the host provides one that advances, -1 otherwise. Without it the members count the
+    // samples themselves, which can leave a member that missed a host callback a block behind
+    // until the next block.
+    void processBlock(SequencerEngine &eng, int numSamples, int64_t hostSampleTime = -1)
+    {
+        if (!group || numSamples <= 0)
+        {
+            eng.processBlock(numSamples);
+            return;
+        }
+        const bool hostTimed = hostSampleTime >= 0 && hostSampleTime != lastHostSampleTime;
+        lastHostSampleTime = hostSampleTime;
+        if (hostTimed)
+            localTime = (uint64_t)hostSampleTime;
+        const uint64_t tag = localTime + 1;
+        // The host time can jump backwards when looping or seeking, so any other block counts
+        // as a new one with it
+        uint64_t claimed = group->claimedTag.load();
+        while (hostTimed ? claimed != tag : claimed < tag)
+        {
+            if (group->claimedTag.compare_exchange_weak(claimed, tag))
+            {
+                eng.processBlock(numSamples);
+                group->pulse.write({tag, numSamples, eng.lastPulseBlock});
+                localTime += numSamples;
+                return;
+            }
+        }
+        // Another member claimed this block, or this engine missed blocks and follows the
+        // latest one. The audio thread never waits for the leader : if its timing isn't
+        // published yet, this block keeps time locally and resyncs with the next one. The
+        // timing of a block of another size can't be followed either, its trigger offsets
+        // could be past the end of this block.
+        SharedPulse pulse;
+        if (group->pulse.read(pulse) && pulse.numSamples == numSamples &&
+            (hostTimed ? pulse.tag == tag : pulse.tag >= claimed))
+        {
+            eng.processBlockFollowing(numSamples, pulse.timing);
+            localTime = pulse.tag - 1 + numSamples;
+            return;
+        }
+        eng.processBlock(numSamples);
+        localTime += numSamples;
+    }
+
+  private:
+    int groupIndex = 0;
+    SharedClockGroup *group = nullptr;
+    uint64_t localTime = 0;
+    int64_t lastHostSampleTime = -1;
+    std::array<uint32_t, RID_LAST> seenRowVersions{};
+};
+
+} // namespace xenakios
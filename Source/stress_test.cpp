@@ -0,0 +1,401 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <print>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "row_engine.h"
+#include "sequencer_engine.h"
+#include "row_playlist.h"
+#include "ump_output.h"
+#include "trace.h"
+
+using namespace xenakios;
+
+// Headless stress test of the sequencing path : randomized block sizes, sample rates, voice
+// counts and row lengths, with an editing thread pushing bursts of row changes through the
+// same FIFO the editor uses, changing parameters like host automation and replacing row
+// playlists. Reports the per-block processing time distribution and checks the engine
+// invariants after every block.
+
+struct StressOptions
+{
+    uint64_t numBlocks = 200000;
+    uint64_t seed = 1;
+    int maxBlockSize = 8192;
+    // Chrome trace output, only written when built with ROWMANAGER_TRACING
+    std::string tracePath;
+};
+
+struct InvariantChecker
+{
+    // start times of the sounding notes, keyed by channel * 128 + note
+    std::map<int, std::deque<uint64_t>> soundingNotes;
+    double maxSampleRate = 0.0;
+    uint64_t numViolations = 0;
+    UmpBuffer packets;
+
+    template <typename... Args> void fail(std::format_string<Args...> fmt, Args &&...args)
+    {
+        if (numViolations < 20)
+        {
+            std::print("INVARIANT VIOLATION : ");
+            std::print(fmt, std::forward<Args>(args)...);
+            std::print("\n");
+        }
+        ++numViolations;
+    }
+
+    void check(SequencerEngine &eng, uint64_t blockStart, int blockSize, int maxBlockSize)
+    {
+        for (auto &ev : eng.outputEvents)
+        {
+            if (ev.note > 127 || ev.velocity > 127 || ev.chan < 1 || ev.chan > 16)
+                fail("event out of MIDI range chan {} note {} velocity {}", ev.chan, ev.note,
+                     ev.velocity);
+            if (ev.offset >= (uint32_t)blockSize)
+                fail("event offset {} outside block of {} samples", ev.offset, blockSize);
+            if (ev.type == SequencerEvent::ControlChange)
+                continue;
+            int key = ev.chan * 128 + ev.note;
+            if (ev.type == SequencerEvent::NoteOn)
+            {
+                soundingNotes[key].push_back(blockStart + ev.offset);
+            }
+            else
+            {
+                auto it = soundingNotes.find(key);
+                if (it == soundingNotes.end() || it->second.empty())
+                    fail("note off without note on, chan {} note {}", ev.chan, ev.note);
+                else
+                    it->second.pop_front();
+            }
+        }
+        // The MIDI 1.0 conversion of the MIDI 2.0 packets must give back the events, with the
+        // per note pressure added after the note ons
+        packets.clear();
+        packets.addEvents(eng.outputEvents);
+        size_t evindex = 0;
+        ump_to_midi1(packets.getPackets(), [&](uint32_t, uint8_t status, uint8_t d1, uint8_t d2) {
+            if ((status & 0xf0) == 0xa0)
+                return;
+            if (evindex == eng.outputEvents.size())
+            {
+                fail("MIDI 1.0 conversion has more messages than events");
+                return;
+            }
+            const auto &ev = eng.outputEvents[evindex++];
+            uint8_t velocity = ev.velocity;
+            if (ev.type == SequencerEvent::NoteOn)
+                velocity = std::max<uint8_t>(velocity, 1);
+            if (status != midi_status(ev) || d1 != ev.note || d2 != velocity)
+                fail("MIDI 1.0 conversion {:x} {} {} of event {:x} {} {}", status, d1, d2,
+                     midi_status(ev), ev.note, ev.velocity);
+        });
+        if (evindex != eng.outputEvents.size())
+            fail("MIDI 1.0 conversion has {} of {} events", evindex, eng.outputEvents.size());
+        // A note must be released within its length plus the block granularity. The note length
+        // dimensions are limited to two sixteenths at 120 BPM here, at any of the sample rates
+        // used so far as the notes keep the length they started with.
+        maxSampleRate = std::max(maxSampleRate, eng.sampleRate);
+        uint64_t blockEnd = blockStart + blockSize;
+        uint64_t maxlen =
+            std::max<uint64_t>(eng.notelen, uint64_t(maxSampleRate / 4.0)) + 2 * maxBlockSize;
+        for (auto &[key, starts] : soundingNotes)
+        {
+            while (!starts.empty() && blockEnd - starts.front() > maxlen)
+            {
+                fail("stuck note chan {} note {}, sounding for {} samples", key / 128, key % 128,
+                     blockEnd - starts.front());
+                starts.pop_front();
+            }
+        }
+        // playingNotes is preallocated for 1024 notes, growing past that would allocate
+        if (eng.playingNotes.size() > 512)
+            fail("{} notes in playingNotes", eng.playingNotes.size());
+        for (size_t i = 0; i < max_poly_voices; ++i)
+        {
+            auto &v = eng.voices[i];
+            for (size_t j = 0; j < RID_LAST; ++j)
+            {
+                auto &it = v.rowIterators[j];
+                if (it.row != &eng.rows[j])
+                    fail("voice {} iterator {} doesn't point to the engine row", i, j);
+                if (it.pos < 0 || it.pos >= eng.rows[j].num_active_entries)
+                    fail("voice {} iterator {} pos {} outside row of {} entries", i, j, it.pos,
+                         eng.rows[j].num_active_entries);
+            }
+            // Only the running voices advance. After a trigger the pulse length is recalculated,
+            // so the position can only be past it by what was left of the block.
+            if (!eng.selfSequence || i >= eng.num_active_voices)
+                continue;
+            if (v.pulselen <= 0 || v.playpos < 0 || v.playpos >= std::max(v.pulselen, blockSize))
+                fail("voice {} playpos {} pulselen {}", i, v.playpos, v.pulselen);
+        }
+    }
+};
+
+// Stands in for the plugin parameters, written from the editing thread like host automation
+struct AutomatedParameters
+{
+    AutomatedParameters()
+    {
+        EngineParameters defaults;
+        for (size_t rid = 0; rid < RID_LAST; ++rid)
+            rowRepeats[rid] = defaults.rowRepeats[rid];
+    }
+    EngineParameters read() const
+    {
+        EngineParameters result;
+        for (size_t rid = 0; rid < RID_LAST; ++rid)
+        {
+            for (size_t v = 0; v < max_poly_voices; ++v)
+                result.transforms[rid][v] = transform_from_index(transforms[rid][v]);
+            result.rowRepeats[rid] = rowRepeats[rid];
+            auto &ms = result.mutations[rid];
+            ms.newTransform = mutations[rid][0];
+            ms.rotate = mutations[rid][1];
+            ms.swapPair = mutations[rid][2];
+            ms.multiply = mutations[rid][3];
+        }
+        result.numActiveVoices = numActiveVoices;
+        result.velocityLow = velocityLow;
+        result.selfSequence = selfSequence;
+        return result;
+    }
+    std::array<std::array<std::atomic<int>, max_poly_voices>, RID_LAST> transforms{};
+    std::array<std::atomic<int>, RID_LAST> rowRepeats{};
+    // in the order of the RowMutationSettings members
+    std::array<std::array<std::atomic<float>, 4>, RID_LAST> mutations{};
+    std::atomic<int> numActiveVoices{2};
+    std::atomic<int> velocityLow{64};
+    std::atomic<bool> selfSequence{true};
+};
+
+inline Row make_random_row(std::mt19937_64 &rng, int len)
+{
+    Row row = Row::make_chromatic(len);
+    std::shuffle(row.entries.begin(), row.entries.begin() + len, rng);
+    return row;
+}
+
+// Runs on its own thread like the editor does, pushing bursts of edits and draining the UI FIFO
+inline void edit_thread(SequencerEngine &eng, toproc_fifo_t &fifo, AutomatedParameters &pars,
+                        std::atomic<bool> &running, uint64_t seed)
+{
+    RM_TRACE_THREAD("edit");
+    std::mt19937_64 rng{seed};
+    RowPlaylistFeeder feeder;
+    MessageToUI uimsg;
+    while (running)
+    {
+        RM_TRACE_SCOPE("edit burst");
+        while (eng.fifo_to_ui.pop(uimsg))
+            ;
+        feeder.refill(eng);
+        int burst = std::uniform_int_distribution<int>(1, 64)(rng);
+        for (int i = 0; i < burst; ++i)
+        {
+            switch (rng() % 16)
+            {
+            case 0:
+                pars.transforms[rng() % RID_LAST][rng() % max_poly_voices] =
+                    rng() % (max_transform_index + 1);
+                break;
+            case 1:
+                pars.rowRepeats[rng() % RID_LAST] = 1 + rng() % 16;
+                break;
+            case 2:
+                pars.numActiveVoices = 1 + rng() % max_poly_voices;
+                break;
+            case 3:
+                pars.velocityLow = rng() % 128;
+                break;
+            case 4:
+                pars.selfSequence = rng() % 4 != 0;
+                break;
+            case 5:
+            {
+                RowPlaylist playlist;
+                int numentries = rng() % 4 == 0 ? 0 : 1 + rng() % 2000;
+                for (int j = 0; j < numentries; ++j)
+                {
+                    int len = std::uniform_int_distribution<int>(1, 32)(rng);
+                    playlist.entries.push_back(
+                        {make_random_row(rng, len), transform_from_index(rng() % 128)});
+                }
+                playlist.loop = rng() % 2 == 0;
+                feeder.setPlaylist(eng, rng() % RID_LAST, std::move(playlist));
+                break;
+            }
+            case 6:
+            {
+                // Indexes past the current dimensions are ignored by the engine
+                MessageToProcessor msg;
+                msg.opcode = rng() % 4 == 0 ? MessageToProcessor::OP_RemoveDimension
+                                            : MessageToProcessor::OP_SetDimension;
+                msg.row_index = rng() % (max_row_dimensions + 1);
+                msg.row = make_random_row(rng, std::uniform_int_distribution<int>(1, 32)(rng));
+                msg.dimension.target = DimensionTarget(rng() % 3);
+                msg.dimension.controller = rng() % 120;
+                msg.dimension.low = rng() % 128;
+                msg.dimension.high = rng() % 128;
+                msg.dimension.repeats = 1 + rng() % 4;
+                // the note off check expects the notes to be at most two sixteenths long
+                if (msg.dimension.target == DimensionTarget::NoteLength)
+                {
+                    msg.dimension.low = 1;
+                    msg.dimension.high = 2;
+                }
+                fifo.push(msg);
+                break;
+            }
+            case 7:
+            {
+                // mostly off or low, so that the rows also get to play through unchanged
+                auto &ms = pars.mutations[rng() % RID_LAST];
+                for (auto &p : ms)
+                    p = rng() % 3 == 0 ? std::uniform_real_distribution<float>(0.0f, 1.0f)(rng)
+                                       : 0.0f;
+                break;
+            }
+            default:
+            {
+                MessageToProcessor msg;
+                msg.opcode = MessageToProcessor::OP_ChangeRow;
+                msg.row_index = rng() % RID_LAST;
+                msg.row = make_random_row(rng, std::uniform_int_distribution<int>(4, 32)(rng));
+                fifo.push(msg);
+            }
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(rng() % 2000));
+    }
+}
+
+inline int run_stress(const StressOptions &opts)
+{
+    RM_TRACE_INIT();
+    RM_TRACE_THREAD("audio");
+    std::mt19937_64 rng{opts.seed};
+    SequencerEngine eng;
+    toproc_fifo_t fifo;
+    fifo.reset(1024);
+    const double samplerates[] = {22050.0, 44100.0, 48000.0, 88200.0, 96000.0, 192000.0};
+    double sr = 44100.0;
+    eng.prepare(sr);
+
+    AutomatedParameters pars;
+    std::atomic<bool> running{true};
+    std::thread editor([&]() { edit_thread(eng, fifo, pars, running, opts.seed + 1); });
+
+    InvariantChecker checker;
+    std::vector<double> blocktimes;
+    blocktimes.reserve(opts.numBlocks);
+    double worstratio = 0.0;
+    int worstblocksize = 0;
+    uint64_t sampletime = 0;
+    uint64_t numevents = 0;
+    std::uniform_int_distribution<int> sizedist(1, opts.maxBlockSize);
+    for (uint64_t i = 0; i < opts.numBlocks; ++i)
+    {
+        // mostly small and power of 2 sizes as hosts use, with occasional arbitrary ones
+        int blocksize = 0;
+        switch (rng() % 4)
+        {
+        case 0:
+            blocksize = sizedist(rng);
+            break;
+        case 1:
+            blocksize = 1 + rng() % 16;
+            break;
+        default:
+            blocksize = std::min(opts.maxBlockSize, 1 << (rng() % 14));
+        }
+        if (rng() % 5000 == 0)
+        {
+            sr = samplerates[rng() % std::size(samplerates)];
+            eng.prepare(sr);
+        }
+
+        auto t0 = std::chrono::steady_clock::now();
+        {
+            RM_TRACE_SCOPE("processBlock");
+            MessageToProcessor msg;
+            while (fifo.pop(msg))
+                eng.handleMessage(msg);
+            eng.applyParameters(pars.read());
+            eng.processBlock(blocksize);
+        }
+        auto t1 = std::chrono::steady_clock::now();
+
+        double elapsed = std::chrono::duration<double>(t1 - t0).count();
+        blocktimes.push_back(elapsed);
+        double ratio = elapsed / (blocksize / sr);
+        if (ratio > worstratio)
+        {
+            worstratio = ratio;
+            worstblocksize = blocksize;
+        }
+        numevents += eng.outputEvents.size();
+        checker.check(eng, sampletime, blocksize, opts.maxBlockSize);
+        sampletime += blocksize;
+    }
+    running = false;
+    editor.join();
+
+    std::sort(blocktimes.begin(), blocktimes.end());
+    auto percentile = [&](double p) {
+        size_t index = std::min(blocktimes.size() - 1, size_t(p * blocktimes.size()));
+        return blocktimes[index] * 1e6;
+    };
+    std::print("{} blocks, {} samples, {} events, seed {}\n", opts.numBlocks, sampletime,
+               numevents, opts.seed);
+    std::print("block time us : median {:.2f} p99 {:.2f} p99.9 {:.2f} max {:.2f}\n",
+               percentile(0.5), percentile(0.99), percentile(0.999), blocktimes.back() * 1e6);
+    std::print("worst CPU use of block duration {:.4f}% (block size {})\n", worstratio * 100.0,
+               worstblocksize);
+    if (!opts.tracePath.empty())
+    {
+#if ROWMANAGER_TRACING
+        if (Tracer::instance().writeChromeTrace(opts.tracePath))
+            std::print("wrote trace of the last blocks to {}\n", opts.tracePath);
+        else
+            std::print("could not write trace to {}\n", opts.tracePath);
+#else
+        std::print("--trace needs a build with ROWMANAGER_TRACING enabled\n");
+#endif
+    }
+    if (checker.numViolations > 0)
+    {
+        std::print("{} invariant violations [FAILED]\n", checker.numViolations);
+        return 1;
+    }
+    std::print("no invariant violations [OK]\n");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    StressOptions opts;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string_view arg{argv[i]};
+        if (arg == "--blocks")
+            opts.numBlocks = std::stoull(argv[i + 1]);
+        else if (arg == "--seed")
+            opts.seed = std::stoull(argv[i + 1]);
+        else if (arg == "--maxblocksize")
+            opts.maxBlockSize = std::clamp(std::stoi(argv[i + 1]), 1, 65536);
+        else if (arg == "--trace")
+            opts.tracePath = argv[i + 1];
+    }
+    if (opts.numBlocks == 0)
+        return 0;
+    return run_stress(opts);
+}
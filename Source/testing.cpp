@@ -1,9 +1,16 @@
+#include <chrono>
 #include <exception>
 #include <filesystem>
+#include <fstream>
+#include <iterator>
 #include <print>
 #include <string>
 #include <string_view>
 #include "row_engine.h"
+#include "sequencer_engine.h"
+#include "session_log.h"
+#include "offline_render.h"
+#include "row_playlist.h"
 #include "audio/choc_AudioFileFormat.h"
 #include "audio/choc_AudioFileFormat_WAV.h"
 
@@ -75,8 +82,135 @@ inline void test_cli_choc_path(std::string path)
     }
 }
 
+inline int replay_session(std::string path)
+{
+    std::ifstream is(std::filesystem::u8path(path), std::ios::binary);
+    if (!is.is_open())
+    {
+        std::print("could not open {}\n", path);
+        return 1;
+    }
+    std::vector<uint8_t> logdata{std::istreambuf_iterator<char>(is),
+                                 std::istreambuf_iterator<char>()};
+    SequencerEngine engine;
+    auto result = replaySessionLog(logdata, engine, [](int, const TransportInfo &) {});
+    if (!result.valid)
+    {
+        std::print("{} : {}\n", path, result.error);
+        return 1;
+    }
+    std::print("{} blocks, {} messages, {} samples replayed\n", result.numBlocks,
+               result.numMessages, result.numSamples);
+    if (result.numMismatches > 0)
+    {
+        std::print("{} blocks differ from the recording, first at sample {} [FAILED]\n",
+                   result.numMismatches, result.firstMismatchSample);
+        return 1;
+    }
+    std::print("output matches the recording [OK]\n");
+    return 0;
+}
+
+// Records a session in which the playlists are replaced while rows of the previous playlists
+// are still queued, then replays it
+inline int replay_check_playlists(std::string logpath)
+{
+    auto engine = std::make_unique<SequencerEngine>();
+    engine->prepare(44100.0);
+    RowPlaylistFeeder feeder;
+    SessionRecorder recorder;
+    if (!recorder.start(logpath))
+    {
+        std::print("could not open {}\n", logpath);
+        return 1;
+    }
+    Xoshiro256 rng(3);
+    TransportInfo transport;
+    MessageToUI msg;
+    for (int i = 0; i < 20000; ++i)
+    {
+        recorder.beginBlock(*engine);
+        if (rng.next() % 400 == 0)
+        {
+            size_t rid = rng.next() % RID_LAST;
+            RowPlaylist playlist;
+            playlist.loop = rng.next() % 2 == 0;
+            size_t numrows = rng.next() % 6;
+            for (size_t j = 0; j < numrows; ++j)
+                playlist.entries.push_back({Row::make_chromatic(2 + rng.next() % 11), {}});
+            feeder.setPlaylist(*engine, rid, std::move(playlist));
+        }
+        feeder.refill(*engine);
+        int numsamples = 1 + rng.next() % 1024;
+        engine->setTempo(transport.bpm);
+        engine->processBlock(numsamples);
+        recorder.endBlock(numsamples, transport, *engine);
+        while (engine->fifo_to_ui.pop(msg))
+            ;
+        // keeps the log writer thread up with the recording
+        if (i % 16 == 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    recorder.stop();
+    return replay_session(logpath);
+}
+
+inline int render_session(std::string outpath, double lengthSeconds, double sampleRate)
+{
+    SequencerEngine engine;
+    engine.prepare(sampleRate);
+    auto t0 = std::chrono::steady_clock::now();
+    if (!render_to_wav(engine, std::filesystem::u8path(outpath), lengthSeconds))
+    {
+        std::print("{} [FAILED]\n", outpath);
+        return 1;
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::print("rendered {} seconds to {} in {:.3f} seconds, {:.0f}x realtime\n", lengthSeconds,
+               outpath, elapsed, lengthSeconds / elapsed);
+    return 0;
+}
+
+inline int batch_render_manifest(std::string manifestpath, std::string outdir,
+                                 unsigned int numThreads)
+{
+    std::ifstream is(std::filesystem::u8path(manifestpath));
+    if (!is.is_open())
+    {
+        std::print("could not open {}\n", manifestpath);
+        return 1;
+    }
+    std::string error;
+    auto jobs = parse_render_manifest(is, error);
+    if (!error.empty())
+    {
+        std::print("{} : {}\n", manifestpath, error);
+        return 1;
+    }
+    std::filesystem::create_directories(std::filesystem::u8path(outdir));
+    if (numThreads == 0)
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    auto t0 = std::chrono::steady_clock::now();
+    auto result = batch_render(jobs, std::filesystem::u8path(outdir), numThreads);
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::print("rendered {} pieces with {} threads in {:.3f} seconds\n", result.numRendered,
+               numThreads, elapsed);
+    for (auto &name : result.failed)
+        std::print("{} [FAILED]\n", name);
+    return result.failed.empty() ? 0 : 1;
+}
+
 int main(int argc, char **argv)
 {
+    if (argc > 2 && std::string_view(argv[1]) == "replay")
+        return replay_session(argv[2]);
+    if (argc > 2 && std::string_view(argv[1]) == "replaycheck")
+        return replay_check_playlists(argv[2]);
+    if (argc > 3 && std::string_view(argv[1]) == "batch")
+        return batch_render_manifest(argv[2], argv[3], argc > 4 ? std::stoul(argv[4]) : 0);
+    if (argc > 3 && std::string_view(argv[1]) == "render")
+        return render_session(argv[2], std::stod(argv[3]),
+                              argc > 4 ? std::stod(argv[4]) : 44100.0);
     if (argc > 1)
         test_cli_choc_path(argv[1]);
     // test_choc_scandinavian();
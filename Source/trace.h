@@ -0,0 +1,235 @@
+#pragma once
+
+// Optional timeline tracing of the audio and UI threads, written out as Chrome trace JSON that
+// can be opened in chrome://tracing or ui.perfetto.dev. Enabled by building with
+// ROWMANAGER_TRACING=1, otherwise the macros expand to nothing and none of this is compiled.
+//
+//   RM_TRACE_THREAD("audio");           names the calling thread in the trace
+//   RM_TRACE_SCOPE("processBlock");     a span lasting until the end of the enclosing scope
+//   RM_TRACE_INSTANT("note on", note);  a point event with an integer argument
+//
+// Event names must be string literals, as only the pointers are stored.
+
+#ifndef ROWMANAGER_TRACING
+#define ROWMANAGER_TRACING 0
+#endif
+
+#if ROWMANAGER_TRACING
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace xenakios
+{
+
+// Single writer ring of trace events, overwriting the oldest events when full. The fields are
+// relaxed atomics so that the exporting thread can read them while the owner thread writes,
+// events that may have been overwritten during the copy are discarded afterwards.
+class TraceRing
+{
+  public:
+    static constexpr size_t capacity = 1 << 16;
+    struct Event
+    {
+        std::atomic<const char *> name{nullptr};
+        std::atomic<uint64_t> start{0};
+        std::atomic<uint64_t> duration{0};
+        std::atomic<int64_t> arg{0};
+        std::atomic<char> phase{0};
+    };
+    struct EventCopy
+    {
+        const char *name = nullptr;
+        uint64_t start = 0;
+        uint64_t duration = 0;
+        int64_t arg = 0;
+        char phase = 0;
+    };
+    TraceRing() : events(std::make_unique<Event[]>(capacity)) {}
+    void push(char phase, const char *name, uint64_t start, uint64_t duration, int64_t arg)
+    {
+        uint64_t index = writeCount.load(std::memory_order_relaxed);
+        auto &ev = events[index & (capacity - 1)];
+        ev.name.store(name, std::memory_order_relaxed);
+        ev.start.store(start, std::memory_order_relaxed);
+        ev.duration.store(duration, std::memory_order_relaxed);
+        ev.arg.store(arg, std::memory_order_relaxed);
+        ev.phase.store(phase, std::memory_order_relaxed);
+        writeCount.store(index + 1, std::memory_order_release);
+    }
+    // Called from the exporting thread
+    void copyEvents(std::vector<EventCopy> &dest) const
+    {
+        uint64_t end = writeCount.load(std::memory_order_acquire);
+        uint64_t begin = end > capacity ? end - capacity : 0;
+        size_t first = dest.size();
+        for (uint64_t i = begin; i < end; ++i)
+        {
+            auto &ev = events[i & (capacity - 1)];
+            dest.push_back({ev.name.load(std::memory_order_relaxed),
+                            ev.start.load(std::memory_order_relaxed),
+                            ev.duration.load(std::memory_order_relaxed),
+                            ev.arg.load(std::memory_order_relaxed),
+                            ev.phase.load(std::memory_order_relaxed)});
+        }
+        // The writer may have wrapped over the oldest events while they were copied
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t endAfter = writeCount.load(std::memory_order_relaxed);
+        if (endAfter > begin + capacity)
+        {
+            size_t overwritten = std::min<uint64_t>(endAfter - begin - capacity, end - begin);
+            dest.erase(dest.begin() + first, dest.begin() + first + overwritten);
+        }
+    }
+    std::atomic<const char *> threadName{nullptr};
+    std::atomic<std::thread::id> owner{};
+
+  private:
+    std::unique_ptr<Event[]> events;
+    std::atomic<uint64_t> writeCount{0};
+};
+
+// Owns the rings of all the traced threads. The rings are allocated up front, a thread claims
+// one with an atomic increment the first time it records an event, so recording never locks or
+// allocates. Threads beyond maxThreads aren't traced. The rings are found by thread id rather
+// than with thread_local, which can allocate on first access in a dynamically loaded plugin.
+class Tracer
+{
+  public:
+    static constexpr size_t maxThreads = 8;
+    // The first call allocates the rings, so it should be made early from a non realtime thread
+    static Tracer &instance()
+    {
+        static Tracer tracer;
+        return tracer;
+    }
+    uint64_t now() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now() - epoch)
+            .count();
+    }
+    TraceRing *ringForThisThread()
+    {
+        auto id = std::this_thread::get_id();
+        size_t numRings = std::min(numClaimed.load(), maxThreads);
+        for (size_t i = 0; i < numRings; ++i)
+            if (rings[i].owner.load(std::memory_order_relaxed) == id)
+                return &rings[i];
+        // Claimed with a compare and swap that stops at maxThreads, so the untraced threads
+        // only read the shared counter instead of incrementing it on every event
+        size_t index = numRings;
+        while (index < maxThreads && !numClaimed.compare_exchange_weak(index, index + 1))
+            ;
+        if (index >= maxThreads)
+            return nullptr;
+        rings[index].owner = id;
+        return &rings[index];
+    }
+    void record(char phase, const char *name, uint64_t start, uint64_t duration, int64_t arg)
+    {
+        if (auto ring = ringForThisThread())
+            ring->push(phase, name, start, duration, arg);
+    }
+    void setThreadName(const char *name)
+    {
+        if (auto ring = ringForThisThread())
+            ring->threadName = name;
+    }
+    // Writes the events currently in the rings as Chrome trace JSON. Can be called from any
+    // thread while the others keep recording.
+    bool writeChromeTrace(const std::string &path) const
+    {
+        std::ofstream os(path);
+        if (!os.is_open())
+            return false;
+        os << "{\"traceEvents\":[\n";
+        bool first = true;
+        std::vector<TraceRing::EventCopy> events;
+        events.reserve(TraceRing::capacity);
+        size_t numRings = std::min(numClaimed.load(), maxThreads);
+        for (size_t tid = 0; tid < numRings; ++tid)
+        {
+            if (auto name = rings[tid].threadName.load())
+            {
+                os << (first ? "" : ",\n")
+                   << std::format("{{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":{},"
+                                  "\"args\":{{\"name\":\"{}\"}}}}",
+                                  tid, name);
+                first = false;
+            }
+            events.clear();
+            rings[tid].copyEvents(events);
+            for (auto &ev : events)
+            {
+                if (!ev.name)
+                    continue;
+                os << (first ? "" : ",\n");
+                first = false;
+                // Chrome trace timestamps are in microseconds
+                if (ev.phase == 'X')
+                    os << std::format("{{\"ph\":\"X\",\"name\":\"{}\",\"pid\":1,\"tid\":{},"
+                                      "\"ts\":{:.3f},\"dur\":{:.3f}}}",
+                                      ev.name, tid, ev.start / 1000.0, ev.duration / 1000.0);
+                else
+                    os << std::format("{{\"ph\":\"i\",\"s\":\"t\",\"name\":\"{}\",\"pid\":1,"
+                                      "\"tid\":{},\"ts\":{:.3f},\"args\":{{\"value\":{}}}}}",
+                                      ev.name, tid, ev.start / 1000.0, ev.arg);
+            }
+        }
+        os << "\n]}\n";
+        return os.good();
+    }
+
+  private:
+    Tracer() = default;
+    const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    std::array<TraceRing, maxThreads> rings;
+    std::atomic<size_t> numClaimed{0};
+};
+
+class TraceScope
+{
+  public:
+    explicit TraceScope(const char *n) : name(n), start(Tracer::instance().now()) {}
+    ~TraceScope()
+    {
+        auto &tracer = Tracer::instance();
+        tracer.record('X', name, start, tracer.now() - start, 0);
+    }
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+  private:
+    const char *name;
+    uint64_t start;
+};
+
+} // namespace xenakios
+
+#define RM_TRACE_CONCAT_IMPL(a, b) a##b
+#define RM_TRACE_CONCAT(a, b) RM_TRACE_CONCAT_IMPL(a, b)
+#define RM_TRACE_SCOPE(name)                                                                       \
+    xenakios::TraceScope RM_TRACE_CONCAT(rm_trace_scope_, __LINE__) { name }
+#define RM_TRACE_INSTANT(name, arg)                                                                \
+    xenakios::Tracer::instance().record('i', name, xenakios::Tracer::instance().now(), 0, (arg))
+#define RM_TRACE_THREAD(name) xenakios::Tracer::instance().setThreadName(name)
+#define RM_TRACE_INIT() (void)xenakios::Tracer::instance()
+
+#else
+
+#define RM_TRACE_SCOPE(name) ((void)0)
+#define RM_TRACE_INSTANT(name, arg) ((void)0)
+#define RM_TRACE_THREAD(name) ((void)0)
+#define RM_TRACE_INIT() ((void)0)
+
+#endif
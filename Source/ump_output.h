@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+#include "sequencer_engine.h"
+
+namespace xenakios
+{
+
+// A MIDI 2.0 channel voice message (message type 4) in Universal MIDI Packet format, with the
+// sample offset it's sent at
+struct UmpPacket
+{
+    uint32_t offset = 0;
+    std::array<uint32_t, 2> words{};
+};
+
+// Note on attribute type 3, the per note pitch in 7.9 fixed point semitones
+constexpr uint8_t ump_attribute_pitch = 0x03;
+
+// The min-center-max scaling of the MIDI 2.0 specification, so that the center and maximum
+// values of the source range map to those of the destination range
+inline uint32_t ump_scale_up(uint32_t value, int srcBits, int dstBits)
+{
+    const int scaleBits = dstBits - srcBits;
+    uint32_t result = value << scaleBits;
+    if (value <= (1u << (srcBits - 1)))
+        return result;
+    const int repeatBits = srcBits - 1;
+    uint32_t repeat = value & ((1u << repeatBits) - 1);
+    if (scaleBits > repeatBits)
+        repeat <<= scaleBits - repeatBits;
+    else
+        repeat >>= repeatBits - scaleBits;
+    while (repeat != 0)
+    {
+        result |= repeat;
+        repeat >>= repeatBits;
+    }
+    return result;
+}
+
+// Fixed capacity buffer of the packets of one block, written straight from the engine's
+// events. The memory is allocated by reset, adding never allocates.
+class UmpBuffer
+{
+  public:
+    UmpBuffer() { reset(8192); }
+    // Not realtime safe
+    void reset(size_t capacity)
+    {
+        packets.resize(capacity);
+        numPackets = 0;
+    }
+    void clear() { numPackets = 0; }
+    // Note ons are followed by the per note pressure at the same offset, in group 0
+    void addEvents(std::span<const SequencerEvent> events)
+    {
+        for (const auto &ev : events)
+        {
+            const uint32_t chan = (ev.chan - 1) & 0x0f;
+            if (ev.type == SequencerEvent::NoteOn)
+            {
+                add(ev.offset, header(0x9, chan, ev.note, ump_attribute_pitch),
+                    (uint32_t(ev.velocity16) << 16) | ev.pitch);
+                add(ev.offset, header(0xa, chan, ev.note, 0), ev.pressure);
+            }
+            else if (ev.type == SequencerEvent::NoteOff)
+                add(ev.offset, header(0x8, chan, ev.note, 0), 0);
+            else
+                add(ev.offset, header(0xb, chan, ev.note, 0), ump_scale_up(ev.velocity, 7, 32));
+        }
+    }
+    std::span<const UmpPacket> getPackets() const { return {packets.data(), numPackets}; }
+    uint64_t getNumDroppedPackets() const { return droppedPackets; }
+
+  private:
+    static uint32_t header(uint32_t status, uint32_t chan, uint8_t index, uint8_t attribute)
+    {
+        return (0x4u << 28) | (status << 20) | (chan << 16) | (uint32_t(index & 0x7f) << 8) |
+               attribute;
+    }
+    void add(uint32_t offset, uint32_t word0, uint32_t word1)
+    {
+        if (numPackets == packets.size())
+        {
+            ++droppedPackets;
+            return;
+        }
+        packets[numPackets++] = {offset, {word0, word1}};
+    }
+    std::vector<UmpPacket> packets;
+    size_t numPackets = 0;
+    uint64_t droppedPackets = 0;
+};
+
+// Converts the packets to MIDI 1.0 in one pass, calling onMessage(offset, status, data1, data2)
+// for each message. The values are scaled down as in the MIDI 2.0 specification, where a note
+// on velocity can't become 0.
+template <typename Callback>
+inline void ump_to_midi1(std::span<const UmpPacket> packets, Callback &&onMessage)
+{
+    for (const auto &p : packets)
+    {
+        const uint32_t w0 = p.words[0];
+        const uint32_t w1 = p.words[1];
+        if ((w0 >> 28) != 0x4)
+            continue;
+        const uint8_t status = uint8_t((w0 >> 16) & 0xff);
+        const uint8_t index = uint8_t((w0 >> 8) & 0x7f);
+        switch (status >> 4)
+        {
+        case 0x8:
+            onMessage(p.offset, status, index, uint8_t(w1 >> 25));
+            break;
+        case 0x9:
+            onMessage(p.offset, status, index, uint8_t(std::max<uint32_t>(w1 >> 25, 1)));
+            break;
+        case 0xa:
+        case 0xb:
+            onMessage(p.offset, status, index, uint8_t(w1 >> 25));
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+} // namespace xenakios